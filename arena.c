@@ -0,0 +1,79 @@
+// Bump allocator. Memory is carved out of large chunks and is only ever given back in bulk: all of it by free_arena(), or everything since a mark by arena_reset()
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 8
+
+struct arena_chunk_t
+{
+   struct arena_chunk_t* next;
+   size_t size;
+   size_t used;
+   unsigned char data[];
+};
+
+typedef struct arena_chunk_t arena_chunk_t;
+
+struct arena_t
+{
+   arena_chunk_t* chunks;    // The newest chunk is first, and is the only one we allocate from
+   size_t chunk_size;
+};
+
+arena_t* alloc_arena(size_t chunk_size)
+{
+   arena_t* a = malloc(sizeof(arena_t));
+   a->chunks = NULL;
+   a->chunk_size = chunk_size;
+   return a;
+}
+
+void* arena_alloc(arena_t* a, size_t size)
+{
+   size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+   if (a->chunks == NULL || a->chunks->used + size > a->chunks->size)
+   {
+      // Oversized requests get a chunk of their own
+      size_t chunk_size = (size > a->chunk_size)?size:a->chunk_size;
+      arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+      chunk->size = chunk_size;
+      chunk->used = 0;
+      chunk->next = a->chunks;
+      a->chunks = chunk;
+   }
+   void* ptr = &a->chunks->data[a->chunks->used];
+   a->chunks->used += size;
+   return ptr;
+}
+
+arena_mark_t arena_mark(arena_t* a)
+{
+   arena_mark_t mark;
+   mark.chunk = a->chunks;
+   mark.used = (a->chunks == NULL)?0:a->chunks->used;
+   return mark;
+}
+
+void arena_reset(arena_t* a, arena_mark_t mark)
+{
+   while (a->chunks != mark.chunk)
+   {
+      arena_chunk_t* chunk = a->chunks;
+      a->chunks = chunk->next;
+      free(chunk);
+   }
+   if (a->chunks != NULL)
+      a->chunks->used = mark.used;
+}
+
+void free_arena(arena_t* a)
+{
+   while (a->chunks)
+   {
+      arena_chunk_t* chunk = a->chunks;
+      a->chunks = chunk->next;
+      free(chunk);
+   }
+   free(a);
+}
@@ -0,0 +1,17 @@
+#include <stddef.h>
+
+typedef struct arena_t arena_t;
+
+arena_t* alloc_arena(size_t chunk_size);
+void* arena_alloc(arena_t* a, size_t size);
+void free_arena(arena_t* a);
+
+// Everything allocated after a mark can be given back by resetting to it, so scratch space can be nested like a stack
+typedef struct
+{
+   void* chunk;
+   size_t used;
+} arena_mark_t;
+
+arena_mark_t arena_mark(arena_t* a);
+void arena_reset(arena_t* a, arena_mark_t mark);
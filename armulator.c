@@ -0,0 +1,212 @@
+// Library interface. The machine itself is the thread-local globals of every module; while one call is using it they are in place on
+// that thread, and the rest of the time they are kept in the handle (see context.h). So a handle can go to whichever thread is free,
+// and a thread can run any number of machines in turn
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "armulator.h"
+#include "machine.h"
+#include "loader.h"
+#include "stubs.h"
+#include "hardware.h"
+#include "coprocessor.h"
+#include "symtab.h"
+#include "image.h"
+#include "function_map.h"
+#include "snapshot.h"
+#include "context.h"
+
+struct armulator_t
+{
+   uint8_t loaded;
+   uint8_t in_use;        // Set while some thread has the machine in place
+   uint32_t holds;        // How many calls (and armulator_hold()s) deep that thread is in it
+   context_t* context;    // The machine's globals, while nobody is using it
+};
+
+// The machine whose globals are in place on this thread, if any, and what the globals hold when there is none. The latter goes
+// when the thread does
+__thread armulator_t* current_machine = NULL;
+__thread context_t* no_machine = NULL;
+pthread_key_t no_machine_key;
+pthread_once_t no_machine_key_created = PTHREAD_ONCE_INIT;
+
+void free_no_machine(void* ptr)
+{
+   free_context(ptr);
+}
+
+void create_no_machine_key()
+{
+   pthread_key_create(&no_machine_key, free_no_machine);
+}
+
+// The coprocessors only hold identification registers, which the guest cannot change, so one set does for every machine
+pthread_once_t coprocessors_configured = PTHREAD_ONCE_INIT;
+
+void claim_machine(armulator_t* machine)
+{
+   uint8_t busy = __atomic_exchange_n(&machine->in_use, 1, __ATOMIC_ACQUIRE);
+   assert(!busy && "A machine can only be used by one thread at a time");
+   assert(current_machine == NULL && "This thread is already using another machine");
+   // Nothing has run on this thread yet, so whatever the globals hold now is what they hold with no machine
+   if (no_machine == NULL)
+   {
+      no_machine = alloc_context();
+      save_context(no_machine);
+      pthread_once(&no_machine_key_created, create_no_machine_key);
+      pthread_setspecific(no_machine_key, no_machine);
+   }
+   machine->holds = 1;
+   current_machine = machine;
+}
+
+void enter_machine(armulator_t* machine)
+{
+   assert(machine != NULL);
+   if (current_machine == machine)
+   {
+      machine->holds++;
+      return;
+   }
+   claim_machine(machine);
+   load_context(machine->context);
+}
+
+void leave_machine(armulator_t* machine)
+{
+   assert(machine == current_machine);
+   if (--machine->holds > 0)
+      return;
+   save_context(machine->context);
+   load_context(no_machine);
+   current_machine = NULL;
+   __atomic_store_n(&machine->in_use, 0, __ATOMIC_RELEASE);
+}
+
+armulator_t* armulator_create()
+{
+   // The machine in place here is part way through something (or held), and a new one would have to take over its globals
+   if (current_machine != NULL)
+      return NULL;
+   pthread_once(&coprocessors_configured, configure_coprocessors);
+   armulator_t* machine = calloc(1, sizeof(armulator_t));
+   machine->context = alloc_context();
+   claim_machine(machine);
+   configure_hardware();
+   initialize_state();
+   prepare_loader();
+   register_stubs();
+   leave_machine(machine);
+   return machine;
+}
+
+int armulator_load(armulator_t* machine, char* executable)
+{
+   enter_machine(machine);
+   exit_reason_t reason = EXIT_LOAD_FAILED;
+   // The initializers count against the budget, and any of them not returning is reported as the reason loading failed
+   if (!machine->loaded)
+   {
+      restart_budgets();
+      if (!load_executable(executable))
+         reason = EXIT_LOAD_FAILED;
+      else if (!machine_stopped(&reason))
+      {
+         dump_symtab();
+         state.next_instruction = state.PC;
+         state.PC = 0;
+         machine->loaded = 1;
+         reason = EXIT_HYPERVISOR_RETURN;
+      }
+   }
+   leave_machine(machine);
+   return reason;
+}
+
+int armulator_load_snapshot(armulator_t* machine, char* snapshot)
+{
+   enter_machine(machine);
+   exit_reason_t reason = EXIT_LOAD_FAILED;
+   if (!machine->loaded)
+   {
+      restart_budgets();
+      if (load_snapshot(snapshot))
+      {
+         machine->loaded = 1;
+         reason = EXIT_HYPERVISOR_RETURN;
+      }
+   }
+   leave_machine(machine);
+   return reason;
+}
+
+// The budgets carry on from loading, so that (as on the command line) the initializers count towards them too
+int armulator_run(armulator_t* machine)
+{
+   enter_machine(machine);
+   assert(machine->loaded);
+   exit_reason_t reason = step_machine();
+   leave_machine(machine);
+   return reason;
+}
+
+uint32_t armulator_exit_status(armulator_t* machine)
+{
+   enter_machine(machine);
+   uint32_t status = exit_status;
+   leave_machine(machine);
+   return status;
+}
+
+int armulator_lookup(armulator_t* machine, char* symbol, uint32_t* address)
+{
+   enter_machine(machine);
+   int found = lookup_symbol(intern(symbol), address);
+   leave_machine(machine);
+   return found;
+}
+
+int armulator_call(armulator_t* machine, uint32_t address, uint32_t argc, uint32_t* args, uint32_t* result)
+{
+   enter_machine(machine);
+   restart_budgets();
+   exit_reason_t reason = call_function(address, argc, args, result);
+   leave_machine(machine);
+   return reason;
+}
+
+void armulator_set_budget(armulator_t* machine, uint64_t instructions, double seconds)
+{
+   enter_machine(machine);
+   set_instruction_budget(instructions);
+   set_time_budget(seconds);
+   leave_machine(machine);
+}
+
+void armulator_hold(armulator_t* machine)
+{
+   enter_machine(machine);
+}
+
+void armulator_release(armulator_t* machine)
+{
+   leave_machine(machine);
+}
+
+// Memory first, since the pre-decoder may still be reading code out of the mapped files. Then the globals are put back as they are
+// with no machine, however many holds there were
+void armulator_destroy(armulator_t* machine)
+{
+   enter_machine(machine);
+   free_machine();
+   free_loader();
+   free_symtab();
+   free_images();
+   free_function_map();
+   free_interned_strings();
+   load_context(no_machine);
+   current_machine = NULL;
+   free_context(machine->context);
+   free(machine);
+}
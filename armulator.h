@@ -0,0 +1,36 @@
+// The emulator as a library (libarmulator.a). Each machine is a whole guest of its own: registers, memory, the shared cache, loaded
+// images and symbols. A machine can be used from any thread, but only by one thread at a time, and a thread can use any number of
+// machines in turn. To run several guests at once, give each one a thread of its own while it runs.
+//
+// Search roots, --bind-now and the like are shared by every machine, and must be set before the first one is created
+#ifndef ARMULATOR_H
+#define ARMULATOR_H
+#include <stdint.h>
+
+typedef struct armulator_t armulator_t;
+
+// NULL if this thread is in the middle of using another machine (see armulator_hold())
+armulator_t* armulator_create();
+// Loads the executable and everything it depends on, and runs their initializers. Returns 0 if that all worked, or else the
+// exit_reason_t: EXIT_LOAD_FAILED if there was nothing to load, or why an initializer (or resolver) did not return
+int armulator_load(armulator_t* machine, char* executable);
+// Instead of armulator_load(), carries on from where a snapshot was taken. EXIT_LOAD_FAILED if it cannot be restored here, after
+// which the machine may be partly restored and is only fit for armulator_destroy()
+int armulator_load_snapshot(armulator_t* machine, char* snapshot);
+// Runs the executable from its entry point (or from where the snapshot was taken). Returns an exit_reason_t (see machine.h)
+int armulator_run(armulator_t* machine);
+// What the guest passed to exit(), once something has returned EXIT_PROCESS_EXIT
+uint32_t armulator_exit_status(armulator_t* machine);
+// Symbols are named as in the image, so C functions need their leading underscore
+int armulator_lookup(armulator_t* machine, char* symbol, uint32_t* address);
+// Calls a function with the given arguments, and returns 0 (with what it returned in *result) if it returned, or the exit_reason_t if not
+int armulator_call(armulator_t* machine, uint32_t address, uint32_t argc, uint32_t* args, uint32_t* result);
+// Applies to each armulator_call() separately, and to loading and armulator_run() together. 0 means unlimited
+void armulator_set_budget(armulator_t* machine, uint64_t instructions, double seconds);
+// For code that works on the machine's internals between calls, as the command line does: keeps the machine in place on this thread
+// (and so out of reach of any other) until armulator_release(), or armulator_destroy(). Calls made in between also skip swapping it
+// in and out
+void armulator_hold(armulator_t* machine);
+void armulator_release(armulator_t* machine);
+void armulator_destroy(armulator_t* machine);
+#endif
@@ -0,0 +1,72 @@
+// Moves a machine's globals in and out of a block of memory. The modules say what their globals are, in the same order every time,
+// so the block is just each of them one after another
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "context.h"
+
+struct context_t
+{
+   unsigned char* data;
+   size_t length;
+   size_t capacity;
+   uint8_t saving;
+};
+
+context_t* alloc_context()
+{
+   return calloc(1, sizeof(context_t));
+}
+
+void free_context(context_t* c)
+{
+   free(c->data);
+   free(c);
+}
+
+void context_var(context_t* c, void* address, size_t size)
+{
+   if (c->saving)
+   {
+      if (c->length + size > c->capacity)
+      {
+         while (c->length + size > c->capacity)
+            c->capacity = (c->capacity == 0)?1024:(c->capacity * 2);
+         c->data = realloc(c->data, c->capacity);
+      }
+      memcpy(&c->data[c->length], address, size);
+   }
+   else
+      memcpy(address, &c->data[c->length], size);
+   c->length += size;
+}
+
+void all_modules(context_t* c)
+{
+   machine_context(c);
+   loader_context(c);
+   symtab_context(c);
+   images_context(c);
+   function_map_context(c);
+   intern_context(c);
+   dyld_cache_context(c);
+   coverage_context(c);
+   snapshot_context(c);
+}
+
+void save_context(context_t* c)
+{
+   c->saving = 1;
+   c->length = 0;
+   all_modules(c);
+}
+
+void load_context(context_t* c)
+{
+   size_t length = c->length;
+   assert(length != 0 && "Nothing has been saved in this context");
+   c->saving = 0;
+   c->length = 0;
+   all_modules(c);
+   assert(c->length == length);
+}
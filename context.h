@@ -0,0 +1,26 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// A machine is the thread-local globals of every module. While nobody is using it they are copied out into a context_t, so that it
+// is not tied to the thread that made it, and a thread can take turns with several (see armulator.c)
+typedef struct context_t context_t;
+
+context_t* alloc_context();
+void free_context(context_t* c);
+// Copies the globals into c, or back out of it
+void save_context(context_t* c);
+void load_context(context_t* c);
+
+// Each module lists its globals in a function of its own, which calls this for every one of them
+void context_var(context_t* c, void* address, size_t size);
+#define CONTEXT_VAR(c, v) context_var(c, &(v), sizeof(v))
+
+void machine_context(context_t* c);
+void loader_context(context_t* c);
+void symtab_context(context_t* c);
+void images_context(context_t* c);
+void function_map_context(context_t* c);
+void intern_context(context_t* c);
+void dyld_cache_context(context_t* c);
+void coverage_context(context_t* c);
+void snapshot_context(context_t* c);
@@ -0,0 +1,124 @@
+// Edge coverage, as AFL does it: every time control flow lands somewhere new, the pair (where the last block started, where this one
+// starts) is hashed into a byte of the map and that byte is bumped. The map lives in System V shared memory, so that a fuzzer (or
+// anything else that knows the id) can read it while we run, and so that the children of a fork server all update the same one
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "loader.h"
+#include "coverage.h"
+#include "context.h"
+
+// Set by AFL when it runs us
+#define AFL_SHM_ENV "__AFL_SHM_ID"
+
+uint8_t* coverage_map = NULL;
+__thread uint32_t previous_location = 0;
+// Only set if we made the map ourselves, in which case it is ours to remove
+int coverage_map_id = -1;
+pid_t coverage_map_owner = 0;
+
+// If any modules are named, only blocks in their segments count (as if nothing else were instrumented). Others are looked through
+char** covered_modules = NULL;
+uint32_t covered_module_count = 0;
+uint8_t* covered_pages = NULL;    // One bit per guest page
+
+// Not every system lets a segment be attached once it is marked for removal, so that waits until we exit. Jobs forked by the fork
+// server exit too, but the map is not theirs to remove
+void remove_coverage_map()
+{
+   if (coverage_map_id != -1 && getpid() == coverage_map_owner)
+      shmctl(coverage_map_id, IPC_RMID, NULL);
+}
+
+int enable_coverage()
+{
+   if (coverage_map != NULL)
+      return 1;
+   int id;
+   char* env = getenv(AFL_SHM_ENV);
+   if (env != NULL)
+      id = atoi(env);
+   else
+   {
+      id = shmget(IPC_PRIVATE, COVERAGE_MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+      if (id == -1)
+      {
+         printf("Could not create shared memory for the coverage map\n");
+         return 0;
+      }
+   }
+   void* map = shmat(id, NULL, 0);
+   if (map == (void*)-1)
+   {
+      printf("Could not attach the coverage map (shared memory id %d)\n", id);
+      if (env == NULL)
+         shmctl(id, IPC_RMID, NULL);
+      return 0;
+   }
+   if (env == NULL)
+   {
+      coverage_map_id = id;
+      coverage_map_owner = getpid();
+      atexit(remove_coverage_map);
+   }
+   coverage_map = map;
+   printf("Coverage map is shared memory id %d\n", id);
+   return 1;
+}
+
+void cover_module(char* name)
+{
+   covered_modules = realloc(covered_modules, sizeof(char*) * (covered_module_count + 1));
+   covered_modules[covered_module_count++] = name;
+   if (covered_pages == NULL)
+      covered_pages = calloc(0x100000000ull / VPAGE_SIZE / 8, 1);
+}
+
+// Modules can be named by their full path or install name, or just by the last part of it
+int is_covered_module(const char* name)
+{
+   const char* base = strrchr(name, '/');
+   base = (base == NULL)?name:base + 1;
+   for (uint32_t i = 0; i < covered_module_count; i++)
+   {
+      if (strcmp(covered_modules[i], name) == 0 || strcmp(covered_modules[i], base) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+void coverage_note_segment(symbol_t module, uint32_t address, uint32_t length)
+{
+   if (covered_pages == NULL || length == 0 || !is_covered_module(module->name))
+      return;
+   for (uint64_t page = address / VPAGE_SIZE; page <= ((uint64_t)address + length - 1) / VPAGE_SIZE; page++)
+      __atomic_fetch_or(&covered_pages[page / 8], 1 << (page % 8), __ATOMIC_RELAXED);   // Machines on other threads may be loading too
+}
+
+// An edge from the end of one run to the start of the next is not a real one
+void coverage_start_run()
+{
+   previous_location = 0;
+}
+
+void coverage_context(context_t* c)
+{
+   CONTEXT_VAR(c, previous_location);
+}
+
+// Fibonacci hashing again (see map.c): block addresses are mostly multiples of 2 or 4, and this spreads them evenly anyway
+#define LOCATION_HASH(address) (((address) * 0x9E3779B1u) >> (32 - COVERAGE_MAP_BITS))
+
+void record_edge(uint32_t address)
+{
+   uint32_t page = address / VPAGE_SIZE;
+   if (covered_pages != NULL && !(covered_pages[page / 8] & (1 << (page % 8))))
+      return;
+   uint32_t location = LOCATION_HASH(address);
+   coverage_map[location ^ previous_location]++;
+   // Shifted so that A->B and B->A are different edges, and so that a block jumping to itself does not always hit byte 0
+   previous_location = location >> 1;
+}
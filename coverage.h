@@ -0,0 +1,14 @@
+#include <stdint.h>
+#include "intern.h"
+
+// AFL's map size, so that the bitmap can be handed straight to its tools
+#define COVERAGE_MAP_BITS 16
+#define COVERAGE_MAP_SIZE (1 << COVERAGE_MAP_BITS)
+
+extern uint8_t* coverage_map;
+
+int enable_coverage();
+void cover_module(char* name);
+void coverage_note_segment(symbol_t module, uint32_t address, uint32_t length);
+void coverage_start_run();
+void record_edge(uint32_t address);
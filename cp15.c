@@ -96,13 +96,13 @@ uint32_t cp15_read(uint8_t size, uint8_t CRn, uint8_t opc1, uint8_t CRm, uint8_t
 void create_register(uint16_t path, uint32_t value)
 {
    if (crn[path >> 12] == NULL)
-      crn[path >> 12] = malloc(sizeof(crn_t));
+      crn[path >> 12] = calloc(1, sizeof(crn_t));
    if (crn[path >> 12]->opc1[(path >> 8) & 0xf] == NULL)
-      crn[path >> 12]->opc1[(path >> 8) & 0xf] = malloc(sizeof(opc1_t));
+      crn[path >> 12]->opc1[(path >> 8) & 0xf] = calloc(1, sizeof(opc1_t));
    if (crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf] == NULL)
-      crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf] = malloc(sizeof(crm_t));
+      crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf] = calloc(1, sizeof(crm_t));
    if (crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf]->opc2[path & 0xf] == NULL)
-      crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf]->opc2[path & 0xf] = malloc(sizeof(opc2_t));
+      crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf]->opc2[path & 0xf] = calloc(1, sizeof(opc2_t));
    crn[path >> 12]->opc1[(path >> 8) & 0xf]->crm[(path >> 4) & 0xf]->opc2[path & 0xf]->value = value;
    printf("Configured %x%x%x%x to be %08x\n", path>>12, path>>8&0xf, path>>4&0xf, path&0xf, value);
 }
@@ -113,17 +113,17 @@ void alias_register(uint16_t alias, uint32_t actual)
    opc2_t* actual_node = crn[actual >> 12]->opc1[(actual >> 8) & 0xf]->crm[(actual >> 4) & 0xf]->opc2[actual & 0xf];
    
    if (crn[alias >> 12] == NULL)
-      crn[alias >> 12] = malloc(sizeof(crn_t));
+      crn[alias >> 12] = calloc(1, sizeof(crn_t));
    if (crn[alias >> 12]->opc1[(alias >> 8) & 0xf] == NULL)
-      crn[alias >> 12]->opc1[(alias >> 8) & 0xf] = malloc(sizeof(opc1_t));
+      crn[alias >> 12]->opc1[(alias >> 8) & 0xf] = calloc(1, sizeof(opc1_t));
    if (crn[alias >> 12]->opc1[(alias >> 8) & 0xf]->crm[(alias >> 4) & 0xf] == NULL)
-      crn[alias >> 12]->opc1[(alias >> 8) & 0xf]->crm[(alias >> 4) & 0xf] = malloc(sizeof(crm_t));
+      crn[alias >> 12]->opc1[(alias >> 8) & 0xf]->crm[(alias >> 4) & 0xf] = calloc(1, sizeof(crm_t));
    crn[alias >> 12]->opc1[(alias >> 8) & 0xf]->crm[(alias >> 4) & 0xf]->opc2[alias & 0xf] = actual_node;
 }
 
 void cp15_init()
 {
-   memset(crn, sizeof(crn), 0);
+   memset(crn, 0, sizeof(crn));
 
    create_register(TPIDRURO,   0x80000000); // Initial value is actually undefined... but the OS may set it?
    create_register(MIDR,       0x410FC073); // Pretend we are a genuine ARM Cortex A7
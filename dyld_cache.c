@@ -1,68 +1,337 @@
 #include "dyld_cache.h"
 #include "loader.h"
 #include "map.h"
+#include "intern.h"
+#include "image.h"
+#include "function_map.h"
+#include "context.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
-map_t* cache_map;
-unsigned char* cache_data;
+// Each machine maps the cache for itself, so that what one guest writes to the data mapping (and the sliding) is not seen by another
+__thread cache_index_header_t* cache_index = NULL;
+__thread size_t cache_index_length = 0;    // Non-zero if the index was mapped from its file, rather than built
+__thread unsigned char* cache_data;
+__thread size_t cache_length;
+uint32_t cache_slide = 0;
+// Pointers in the data mapping are only slid a page at a time, as each page is first touched. One bit per page says it has been done
+__thread struct dyld_cache_mapping_info* data_mapping = NULL;
+__thread struct dyld_cache_slide_info* slide_info = NULL;
+__thread uint8_t* slid_pages = NULL;
 
-void load_dyld_cache(char* filename)
+// Work out everything the index needs from the cache itself. This reads the path of every image, so is only done once per cache
+cache_index_header_t* build_cache_index(struct dyld_cache_header* header, size_t* index_length)
 {
-   cache_map = alloc_char_map(free);
-   FILE* file = fopen(filename, "rb");
-   size_t file_length;
-   
-   fseek(file, 0, SEEK_END);
-   file_length = ftell(file);
-   fseek(file, 0, SEEK_SET);
-   cache_data = malloc(file_length);
-   fread(cache_data, file_length, 1, file);
-   fclose(file);
-
-   struct dyld_cache_header* header = (struct dyld_cache_header*)cache_data;
-   assert(strcmp(header->magic, "dyld_v1   armv7") == 0);
    struct dyld_cache_image_info* images = (struct dyld_cache_image_info*)&cache_data[header->imagesOffset];
    struct dyld_cache_mapping_info* map_info = (struct dyld_cache_mapping_info*)&cache_data[header->mappingOffset];
-   printf("Cache is located at %p and is 0x%08zx bytes long\n", cache_data, file_length);
-   for (int i = 0; i < header->mappingCount; i++)
-      printf("Mapping: %016llx-%016llx -> %016llx\n", (&map_info[i])->address, (&map_info[i])->address+(&map_info[i])->size, (&map_info[i])->fileOffset);
+   uint32_t slot_count = 64;
+   // Keep the load factor under a half
+   while (slot_count < header->imagesCount * 2)
+      slot_count *= 2;
+   cache_index_image_t* index_images = calloc(sizeof(cache_index_image_t), header->imagesCount);
    for (int i = 0; i < header->imagesCount; i++)
    {
       struct dyld_cache_image_info* image = &images[i];
-      uint64_t* file_offset = NULL;
+      uint8_t found = 0;
       for (int j = 0; j < header->mappingCount; j++)
       {
          struct dyld_cache_mapping_info* mapping = &map_info[j];
          if (image->address >= mapping->address && image->address <= mapping->address + mapping->size)
          {
-            file_offset = malloc(sizeof(uint64_t));
-            *file_offset = mapping->fileOffset + (image->address - mapping->address);
-            //*file_offset = mapping->address;
+            index_images[i].file_offset = mapping->fileOffset + (image->address - mapping->address);
+            found = 1;
             break;
          }
       }
-      assert(file_offset != NULL);
-      printf("Found image %s in cache at %016llx -> %016llx\n", &cache_data[image->pathFileOffset], image->address, *file_offset);
-      map_put(cache_map, strdup((char*)&cache_data[image->pathFileOffset]), file_offset);
+      assert(found);
+      index_images[i].hash = djb2(&cache_data[image->pathFileOffset]);
+      index_images[i].path_offset = image->pathFileOffset;
+   }
+
+   // Lay it all out in one block, so that it can be written (and later mapped) as is
+   *index_length = sizeof(cache_index_header_t) + sizeof(uint32_t) * slot_count + sizeof(cache_index_image_t) * header->imagesCount;
+   cache_index_header_t* index = calloc(*index_length, 1);
+   memcpy(index->magic, CACHE_INDEX_MAGIC, 16);
+   memcpy(index->uuid, header->uuid, 16);
+   index->image_count = header->imagesCount;
+   index->slot_count = slot_count;
+   index->slots_offset = sizeof(cache_index_header_t);
+   index->images_offset = index->slots_offset + sizeof(uint32_t) * slot_count;
+   uint32_t* slots = (uint32_t*)((unsigned char*)index + index->slots_offset);
+   memcpy((unsigned char*)index + index->images_offset, index_images, sizeof(cache_index_image_t) * header->imagesCount);
+   for (uint32_t i = 0; i < header->imagesCount; i++)
+   {
+      uint32_t j = index_images[i].hash & (slot_count - 1);
+      while (slots[j] != 0)
+         j = (j + 1) & (slot_count - 1);
+      slots[j] = i + 1;
+   }
+   free(index_images);
+   return index;
+}
+
+// The index is mapped and used as is, so anything it points at has to be inside it (and inside the cache)
+int cache_index_valid(struct dyld_cache_header* header)
+{
+   if (cache_index_length < sizeof(cache_index_header_t) || memcmp(cache_index->magic, CACHE_INDEX_MAGIC, 16) != 0 || memcmp(cache_index->uuid, header->uuid, 16) != 0)
+      return 0;
+   if (cache_index->image_count != header->imagesCount || cache_index->slot_count == 0 || (cache_index->slot_count & (cache_index->slot_count - 1)) != 0)
+      return 0;
+   if ((uint64_t)cache_index->slots_offset + (uint64_t)cache_index->slot_count * sizeof(uint32_t) > cache_index_length)
+      return 0;
+   if ((uint64_t)cache_index->images_offset + (uint64_t)cache_index->image_count * sizeof(cache_index_image_t) > cache_index_length)
+      return 0;
+   cache_index_image_t* images = (cache_index_image_t*)((unsigned char*)cache_index + cache_index->images_offset);
+   for (uint32_t i = 0; i < cache_index->image_count; i++)
+   {
+      if (images[i].file_offset + sizeof(struct mach_header) > cache_length || images[i].path_offset >= cache_length)
+         return 0;
+   }
+   return 1;
+}
+
+// Written under a name of its own and then renamed into place, so that another process never maps one that is half written
+void write_cache_index(char* index_filename, size_t index_length)
+{
+   char* temporary = malloc(strlen(index_filename) + 32);
+   sprintf(temporary, "%s.tmp.%d", index_filename, (int)getpid());
+   FILE* file = fopen(temporary, "wb");
+   int written = file != NULL && fwrite(cache_index, index_length, 1, file) == 1;
+   if (file != NULL && fclose(file) != 0)
+      written = 0;
+   if (!written || rename(temporary, index_filename) != 0)
+   {
+      printf("Could not write cache index to %s. It will be rebuilt next time\n", index_filename);
+      unlink(temporary);
+   }
+   free(temporary);
+}
+
+void load_dyld_cache(char* filename)
+{
+   size_t file_length;
+   // Only the parts of the cache belonging to images we actually load ever get read in
+   cache_data = map_file(filename, &file_length);
+   if (cache_data == NULL)
+   {
+      // Everything will have to come from the search roots instead
+      printf("No shared cache at %s\n", filename);
+      return;
+   }
+   cache_length = file_length;
+
+   struct dyld_cache_header* header = (struct dyld_cache_header*)cache_data;
+   if (file_length < sizeof(struct dyld_cache_header) || strcmp(header->magic, "dyld_v1   armv7") != 0)
+   {
+      // It is still one of the mapped files, so it is unmapped with the rest
+      printf("%s is not an armv7 shared cache\n", filename);
+      cache_data = NULL;
+      cache_length = 0;
+      return;
+   }
+   struct dyld_cache_mapping_info* map_info = (struct dyld_cache_mapping_info*)&cache_data[header->mappingOffset];
+   printf("Cache is located at %p and is 0x%08zx bytes long\n", cache_data, file_length);
+   if (cache_slide != 0)
+   {
+      // The second mapping is the writable data, which is what the slide info describes
+      assert(header->mappingCount > 1 && header->slideInfoSize != 0);
+      data_mapping = &map_info[1];
+      slide_info = (struct dyld_cache_slide_info*)&cache_data[header->slideInfoOffset];
+      assert(slide_info->version == 1);
+      slid_pages = calloc((slide_info->toc_count + 7) / 8, 1);
+      printf("Cache will be slid by %08x (%d data pages)\n", cache_slide, slide_info->toc_count);
+   }
+
+   // The index lives next to the cache. It is only any good if it was built from this exact cache
+   char* index_filename = malloc(strlen(filename) + strlen(CACHE_INDEX_SUFFIX) + 1);
+   sprintf(index_filename, "%s%s", filename, CACHE_INDEX_SUFFIX);
+   if (access(index_filename, F_OK) != -1)
+   {
+      // The guest never sees the index, so unlike the cache it is not noted as a mapped file
+      cache_index = (cache_index_header_t*)map_whole_file(index_filename, &cache_index_length);
+      if (cache_index != NULL && !cache_index_valid(header))
+      {
+         printf("Cache index %s is stale\n", index_filename);
+         munmap(cache_index, cache_index_length);
+         cache_index = NULL;
+      }
+      if (cache_index == NULL)
+         cache_index_length = 0;
+   }
+   if (cache_index == NULL)
+   {
+      size_t index_length;
+      cache_index = build_cache_index(header, &index_length);
+      write_cache_index(index_filename, index_length);
+   }
+   printf("Cache has %d images\n", cache_index->image_count);
+   free(index_filename);
+   // The cache itself stays mapped until free_dyld_cache(), since who knows what our executable may end up trying to load in the future
+}
+
+// The cache file is one of the loader's mapped files, so it is unmapped along with the rest of them
+void free_dyld_cache()
+{
+   if (cache_index_length != 0)
+      munmap(cache_index, cache_index_length);
+   else
+      free(cache_index);
+   free(slid_pages);
+   cache_index = NULL;
+   cache_index_length = 0;
+   cache_data = NULL;
+   cache_length = 0;
+   data_mapping = NULL;
+   slide_info = NULL;
+   slid_pages = NULL;
+}
+
+void dyld_cache_context(context_t* c)
+{
+   CONTEXT_VAR(c, cache_index);
+   CONTEXT_VAR(c, cache_index_length);
+   CONTEXT_VAR(c, cache_data);
+   CONTEXT_VAR(c, cache_length);
+   CONTEXT_VAR(c, data_mapping);
+   CONTEXT_VAR(c, slide_info);
+   CONTEXT_VAR(c, slid_pages);
+}
+
+cache_index_image_t* find_cache_image(symbol_t path)
+{
+   if (cache_index == NULL)
+      return NULL;
+   uint32_t* slots = (uint32_t*)((unsigned char*)cache_index + cache_index->slots_offset);
+   cache_index_image_t* images = (cache_index_image_t*)((unsigned char*)cache_index + cache_index->images_offset);
+   uint32_t mask = cache_index->slot_count - 1;
+   for (uint32_t i = path->hash & mask; slots[i] != 0; i = (i + 1) & mask)
+   {
+      cache_index_image_t* image = &images[slots[i] - 1];
+      if (image->hash == path->hash && strcmp((char*)&cache_data[image->path_offset], path->name) == 0)
+         return image;
+   }
+   return NULL;
+}
+
+int in_cache(unsigned char* data)
+{
+   return cache_data != NULL && data >= cache_data && data < cache_data + cache_length;
+}
+
+// Called (via map_addr) with the slid address of a page of a cache image, just before that page is first used
+void slide_cache_page(uint32_t address)
+{
+   uint64_t unslid = (uint32_t)(address - cache_slide);
+   if (unslid < data_mapping->address || unslid >= data_mapping->address + data_mapping->size)
+      return;
+   uint32_t page = (unslid - data_mapping->address) / DYLD_CACHE_PAGE_SIZE;
+   if (page >= slide_info->toc_count || (slid_pages[page / 8] & (1 << (page % 8))))
+      return;
+   slid_pages[page / 8] |= (1 << (page % 8));
+   uint16_t* toc = (uint16_t*)((unsigned char*)slide_info + slide_info->toc_offset);
+   uint8_t* bits = (unsigned char*)slide_info + slide_info->entries_offset + toc[page] * slide_info->entries_size;
+   unsigned char* content = &cache_data[data_mapping->fileOffset + page * DYLD_CACHE_PAGE_SIZE];
+   // Each bit of the entry stands for one 32 bit word of the page that holds a pointer
+   for (int i = 0; i < slide_info->entries_size; i++)
+   {
+      if (bits[i] == 0)
+         continue;
+      for (int j = 0; j < 8; j++)
+      {
+         if (bits[i] & (1 << j))
+         {
+            uint32_t value;
+            memcpy(&value, &content[(i * 8 + j) * 4], 4);
+            value += cache_slide;
+            memcpy(&content[(i * 8 + j) * 4], &value, 4);
+         }
+      }
+   }
+}
+
+// Which pages of the cache have been slid already (NULL if it is not being slid), so a snapshot can keep track of them
+uint8_t* cache_slid_pages(uint32_t* length)
+{
+   *length = (slid_pages == NULL)?0:(slide_info->toc_count + 7) / 8;
+   return slid_pages;
+}
+
+void report_functions(image_t* image, struct nlist* symbols, uint32_t count, char* strings)
+{
+   for (uint32_t i = 0; i < count; i++)
+   {
+      if ((symbols[i].n_type & N_TYPE) == N_SECT)
+         found_function(image->name, intern(&strings[symbols[i].n_un.n_strx]), (symbols[i].n_value + image->slide) | ((symbols[i].n_desc & N_ARM_THUMB_DEF)?1:0));
+   }
+}
+
+// Reports the functions of a cache image to the function map. The exported ones are still in the image's own symbol table, but the
+// local ones were moved out into a blob of their own at the end of the cache
+void symbolize_cache_image(void* context)
+{
+   image_t* image = context;
+   struct dyld_cache_header* header = (struct dyld_cache_header*)cache_data;
+   struct mach_header* mach_header = (struct mach_header*)image->data;
+   struct load_command* command = (struct load_command*)(image->data + sizeof(struct mach_header));
+   for (int i = 0; i < mach_header->ncmds; i++)
+   {
+      if (command->cmd == LC_SYMTAB)
+      {
+         struct symtab_command* c = (struct symtab_command*)command;
+         report_functions(image, (struct nlist*)&cache_data[c->symoff], c->nsyms, (char*)&cache_data[c->stroff]);
+      }
+      else if (command->cmd == LC_FUNCTION_STARTS)
+      {
+         struct linkedit_data_command* c = (struct linkedit_data_command*)command;
+         report_function_starts(image, &cache_data[c->dataoff], c->datasize);
+      }
+      command = (struct load_command*)((char*)command + command->cmdsize);
    }
-   //free(cache);   Not until much later? Maybe never, since who knows what our executable may end up trying to load in the future
+   if (header->localSymbolsSize == 0)
+      return;
+   unsigned char* local_symbols = &cache_data[header->localSymbolsOffset];
+   struct dyld_cache_local_symbols_info* info = (struct dyld_cache_local_symbols_info*)local_symbols;
+   struct dyld_cache_local_symbols_entry* entries = (struct dyld_cache_local_symbols_entry*)&local_symbols[info->entriesOffset];
+   for (uint32_t i = 0; i < info->entriesCount; i++)
+   {
+      if (entries[i].dylibOffset == image->offset)
+      {
+         struct nlist* symbols = &((struct nlist*)&local_symbols[info->nlistOffset])[entries[i].nlistStartIndex];
+         report_functions(image, symbols, entries[i].nlistCount, (char*)&local_symbols[info->stringsOffset]);
+         break;
+      }
+   }
+   printf("Read function names for %s from the cache\n", image->name->name);
 }
 
+int find_in_cache(char* filename, unsigned char** data, uint32_t* offset)
+{
+   cache_index_image_t* image = find_cache_image(intern(filename));
+   if (image != NULL)
+   {
+      printf("--- Cache hit for %s! (%08llx)\n", filename, image->file_offset);
+      *data = &cache_data[image->file_offset];
+      *offset = image->file_offset;
+      return 1;
+   }
+   printf(" --- Cache miss for %s\n", filename);
+   return 0;
+}
 
 int try_cache(char* filename)
 {
-   uint64_t* address;
-   if (map_get(cache_map, filename, (void**)&address))
+   unsigned char* data;
+   uint32_t offset;
+   if (find_in_cache(filename, &data, &offset))
    {
-      printf("--- Cache hit for %s! (%08llx)\n", filename, *address);
-      parse_executable(&cache_data[*address], *address, filename);
+      parse_executable(data, offset, filename);
       return 1;      
    }
-   printf(" --- Cache miss for %s\n", filename);
    return 0;
 }
 
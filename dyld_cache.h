@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include "intern.h"
 
 struct dyld_cache_header
 {
@@ -64,5 +65,39 @@ struct dyld_cache_local_symbols_entry
 	uint32_t	nlistCount;			// number of local symbols for this dylib
 };
 
+// Sidecar index, written next to the cache the first time it is used so later runs can just map it.
+// Layout: the header, then slot_count hash slots (image index + 1, or 0 if empty), then the images
+#define CACHE_INDEX_MAGIC "armulator-idx-2"
+#define CACHE_INDEX_SUFFIX ".index"
+
+typedef struct
+{
+   char magic[16];
+   uint8_t uuid[16];             // Of the cache this index describes
+   uint32_t image_count;
+   uint32_t slot_count;          // Always a power of two
+   uint32_t slots_offset;
+   uint32_t images_offset;
+} cache_index_header_t;
+
+typedef struct
+{
+   uint64_t file_offset;         // Of the mach header
+   uint32_t hash;                // djb2 of the path, the same as intern() gives it
+   uint32_t path_offset;         // The path itself is in the cache
+} cache_index_image_t;
+
+// Slide info works in pages of this size, whatever the page size of the host
+#define DYLD_CACHE_PAGE_SIZE 4096
+
+extern uint32_t cache_slide;
+
 void load_dyld_cache(char*);
+void free_dyld_cache();
+int in_cache(unsigned char* data);
+cache_index_image_t* find_cache_image(symbol_t path);
+void slide_cache_page(uint32_t address);
+uint8_t* cache_slid_pages(uint32_t* length);
+void symbolize_cache_image(void* context);
 int try_cache(char*);
+int find_in_cache(char* filename, unsigned char** data, uint32_t* offset);
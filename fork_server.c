@@ -0,0 +1,172 @@
+// Fork server. The executable is loaded and initialized once, and then every job runs in a fork() of that process, so each one starts
+// from the same freshly initialized machine (and decode cache) without paying for any of it again.
+//
+// Clients connect to a Unix socket, one job per connection. A job is a 32 bit length followed by that many bytes of input, which the
+// guest finds at FORK_SERVER_INPUT (with the address in r0 and the length in r1). The reply is the 32 bit exit status of the job and
+// a 32 bit length, followed by that much of whatever the job printed. A job that cannot be run at all (because its input is over
+// FORK_SERVER_MAX_INPUT, say) gets an exit status of -1 and the reason as its output
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "machine.h"
+#include "loader.h"
+#include "fork_server.h"
+#include "coverage.h"
+
+int read_fully(int fd, void* buffer, size_t length)
+{
+   unsigned char* p = buffer;
+   while (length > 0)
+   {
+      ssize_t got = read(fd, p, length);
+      if (got <= 0)
+         return 0;
+      p += got;
+      length -= got;
+   }
+   return 1;
+}
+
+int write_fully(int fd, void* buffer, size_t length)
+{
+   unsigned char* p = buffer;
+   while (length > 0)
+   {
+      ssize_t sent = write(fd, p, length);
+      if (sent <= 0)
+         return 0;
+      p += sent;
+      length -= sent;
+   }
+   return 1;
+}
+
+// Runs in the child. Never returns
+void run_job(unsigned char* input, uint32_t length, FILE* output)
+{
+   dup2(fileno(output), STDOUT_FILENO);
+   // The pre-decoder thread did not come with us, and may have been holding its lock when we forked
+   predecoding = 0;
+   // Rounding up this way always leaves a zero byte after the input, for guests that expect a string
+   unsigned char* memory = calloc((length + VPAGE_SIZE) & ~(VPAGE_SIZE - 1), 1);
+   if (memory == NULL)
+   {
+      printf("Could not allocate %u bytes for the input\n", length);
+      exit(-1);
+   }
+   memcpy(memory, input, length);
+   map_memory(memory, FORK_SERVER_INPUT, length);
+   state.r[0] = FORK_SERVER_INPUT;
+   state.r[1] = length;
+   restart_budgets();
+   coverage_start_run();
+   exit_reason_t reason = step_machine();
+   report_exit(reason);
+   if (reason == EXIT_PROCESS_EXIT)
+      exit(exit_status);
+   exit((reason == EXIT_HYPERVISOR_RETURN)?0:-1);
+}
+
+int reply(int connection, int32_t result, unsigned char* printed, uint32_t length)
+{
+   return write_fully(connection, &result, sizeof(int32_t)) &&
+          write_fully(connection, &length, sizeof(uint32_t)) &&
+          write_fully(connection, printed, length);
+}
+
+// The input is left unread, since the connection is closed straight after
+int refuse_job(int connection, char* reason)
+{
+   printf("Refusing job: %s", reason);
+   return reply(connection, -1, (unsigned char*)reason, strlen(reason));
+}
+
+int serve_job(int connection)
+{
+   uint32_t length;
+   char reason[128];
+   if (!read_fully(connection, &length, sizeof(uint32_t)))
+      return 0;
+   if (length > FORK_SERVER_MAX_INPUT)
+   {
+      sprintf(reason, "Input of %u bytes is more than the limit of %u\n", length, FORK_SERVER_MAX_INPUT);
+      return refuse_job(connection, reason);
+   }
+   unsigned char* input = malloc(length);
+   if (input == NULL && length > 0)
+   {
+      sprintf(reason, "Could not allocate %u bytes for the input\n", length);
+      return refuse_job(connection, reason);
+   }
+   if (length > 0 && !read_fully(connection, input, length))
+   {
+      free(input);
+      return 0;
+   }
+   FILE* output = tmpfile();
+   assert(output != NULL);
+   // Otherwise anything still buffered would be printed again by the child
+   fflush(stdout);
+   pid_t child = fork();
+   assert(child != -1);
+   if (child == 0)
+   {
+      close(connection);
+      run_job(input, length, output);
+   }
+   free(input);
+   int status;
+   assert(waitpid(child, &status, 0) == child);
+   // Same as a shell would report it
+   int32_t result = WIFEXITED(status)?WEXITSTATUS(status):(128 + WTERMSIG(status));
+   uint32_t output_length = ftell(output);
+   unsigned char* printed = malloc(output_length);
+   rewind(output);
+   int ok = (output_length == 0 || fread(printed, output_length, 1, output) == 1) && reply(connection, result, printed, output_length);
+   free(printed);
+   fclose(output);
+   return ok;
+}
+
+int run_fork_server(char* socket_path)
+{
+   struct sockaddr_un address;
+   int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   assert(listener != -1);
+   memset(&address, 0, sizeof(struct sockaddr_un));
+   address.sun_family = AF_UNIX;
+   if (strlen(socket_path) >= sizeof(address.sun_path))
+   {
+      printf("Socket path %s is too long\n", socket_path);
+      return -1;
+   }
+   strcpy(address.sun_path, socket_path);
+   unlink(socket_path);
+   if (bind(listener, (struct sockaddr*)&address, sizeof(struct sockaddr_un)) != 0 || listen(listener, 16) != 0)
+   {
+      printf("Could not listen on %s\n", socket_path);
+      return -1;
+   }
+   // A client hanging up early should not take the server with it
+   signal(SIGPIPE, SIG_IGN);
+   printf("Fork server ready on %s\n", socket_path);
+   fflush(stdout);
+   uint64_t jobs = 0;
+   while (1)
+   {
+      int connection = accept(listener, NULL, NULL);
+      if (connection == -1)
+         continue;
+      if (!serve_job(connection))
+         printf("Lost the connection for job %llu\n", jobs);
+      close(connection);
+      jobs++;
+   }
+   return 0;
+}
@@ -0,0 +1,6 @@
+// Where each job's input is put in guest memory
+#define FORK_SERVER_INPUT 0xb0000000
+// The input (and the zero byte after it) has to fit below the stack, which starts 512k below 0xd0000000 (see initialize_state())
+#define FORK_SERVER_MAX_INPUT (0xd0000000 - 512*1024 - FORK_SERVER_INPUT - VPAGE_SIZE)
+
+int run_fork_server(char* socket_path);
@@ -1,91 +1,231 @@
-// NB: This is not very efficient. Ideally we should rebalance the whole thing either when necessary, or after loading each symtab.
+// Functions are kept in an array sorted by address. Symbols mostly arrive in ascending order, so appending usually keeps it sorted;
+// if not, we sort once on the next lookup. Each function is assumed to extend up to the start of the next one
 
 
 #include "map.h"
 #include "machine.h"
+#include "function_map.h"
+#include "context.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 
-struct tree_node_t
+typedef struct
 {
-   char* function;
-   char* module;
    uint32_t address;
-   struct tree_node_t* left;
-   struct tree_node_t* right;  
-};
+   symbol_t function;    // NULL if we only know there is a function here (from LC_FUNCTION_STARTS), not what it is called
+   symbol_t module;
+   uint8_t thumb;
+} function_t;
 
-typedef struct tree_node_t tree_node_t;
+__thread function_t* functions = NULL;
+__thread uint32_t function_count = 0;
+__thread uint32_t function_capacity = 0;
+__thread uint8_t functions_sorted = 1;
+__thread uint32_t last_hit = 0;    // Execution tends to stay in one function for a while, so check where we were last time first
+__thread uint8_t last_hit_valid = 0;    // Unless a pending range (which might hold more functions) starts before the next function
 
-tree_node_t* function_map = NULL;
+// Address ranges whose functions have not been read yet, sorted by start. The first lookup that lands in one calls its symbolizer,
+// which reports everything in the range through found_function()
+typedef struct
+{
+   uint32_t start;
+   uint32_t end;
+   void (*symbolize)(void*);
+   void* context;
+} pending_range_t;
+
+__thread pending_range_t* pending_ranges = NULL;
+__thread uint32_t pending_range_count = 0;
+__thread uint32_t pending_range_capacity = 0;
 
-void found_function(char* module, char* function, uint32_t address)
+// The low bit of the address says whether the function is Thumb code, as in a BX target
+void found_function(symbol_t module, symbol_t function, uint32_t address)
 {
-   tree_node_t** f = &function_map;
-   while (1)
-   {     
-      if (*f == NULL)
-      {
-         *f = malloc(sizeof(tree_node_t));
-         (*f)->function = strdup(function);
-         (*f)->module = strdup(module);
-         (*f)->address = address;         
-         (*f)->left = NULL;
-         (*f)->right = NULL;
-         break;
-      }
+   if (function_count == function_capacity)
+   {
+      function_capacity = (function_capacity == 0)?1024:(function_capacity * 2);
+      functions = realloc(functions, sizeof(function_t) * function_capacity);
+   }
+   if (function_count > 0 && address < functions[function_count-1].address)
+      functions_sorted = 0;
+   functions[function_count].address = address & ~1;
+   functions[function_count].function = function;
+   functions[function_count].module = module;
+   functions[function_count].thumb = address & 1;
+   function_count++;
+}
+
+int compare_functions(const void* a, const void* b)
+{
+   uint32_t x = ((function_t*)a)->address;
+   uint32_t y = ((function_t*)b)->address;
+   if (x != y)
+      return (x > y) - (x < y);
+   // Where a function is known both with and without a name, sort the unnamed one first so the search below finds the named one
+   return (((function_t*)a)->function != NULL) - (((function_t*)b)->function != NULL);
+}
+
+void sort_functions()
+{
+   if (!functions_sorted)
+   {
+      qsort(functions, function_count, sizeof(function_t), compare_functions);
+      functions_sorted = 1;
+      last_hit = 0;
+   }
+}
+
+void forall_function_entries(uint32_t start, uint32_t end, void (*fn)(uint32_t address, uint8_t thumb))
+{
+   sort_functions();
+   // Find the first function at or after start, so that each section only costs as much as the functions in it
+   uint32_t low = 0;
+   uint32_t high = function_count;
+   while (low < high)
+   {
+      uint32_t middle = low + (high - low) / 2;
+      if (functions[middle].address < start)
+         low = middle + 1;
       else
-      {
-         if (address < (*f)->address)
-         {  // Look left. This is the easy case
-            f = &(*f)->left;
-         }
-         else
-         {
-            if ((*f)->right != NULL && (*f)->right->address > address)
-            {
-               tree_node_t* new_node = malloc(sizeof(tree_node_t));
-               new_node->function = strdup(function);
-               new_node->module = strdup(module);
-               new_node->address = address;         
-               new_node->left = NULL;
-               new_node->right = (*f)->right;
-               (*f)->right = new_node;
-               break;
-               // Make (*f)->right the child of the new node
-            }
-            else
-            {  // Look right
-               f = &(*f)->right;
-            }
-         }
-      }
+         high = middle;
+   }
+   for (uint32_t i = low; i < function_count && functions[i].address < end; i++)
+   {
+      if (i == 0 || functions[i-1].address != functions[i].address)
+         fn(functions[i].address, functions[i].thumb);
    }
 }
 
+void add_pending_functions(uint32_t start, uint32_t end, void (*symbolize)(void*), void* context)
+{
+   if (pending_range_count == pending_range_capacity)
+   {
+      pending_range_capacity = (pending_range_capacity == 0)?64:(pending_range_capacity * 2);
+      pending_ranges = realloc(pending_ranges, sizeof(pending_range_t) * pending_range_capacity);
+   }
+   uint32_t i = pending_range_count;
+   while (i > 0 && pending_ranges[i-1].start > start)
+   {
+      pending_ranges[i] = pending_ranges[i-1];
+      i--;
+   }
+   pending_ranges[i].start = start;
+   pending_ranges[i].end = end;
+   last_hit_valid = 0;
+   pending_ranges[i].symbolize = symbolize;
+   pending_ranges[i].context = context;
+   pending_range_count++;
+}
+
+void symbolize_pending_range(uint32_t address)
+{
+   if (pending_range_count == 0 || address < pending_ranges[0].start)
+      return;
+   uint32_t low = 0;
+   uint32_t high = pending_range_count - 1;
+   while (low < high)
+   {
+      uint32_t mid = low + (high - low + 1) / 2;
+      if (pending_ranges[mid].start <= address)
+         low = mid;
+      else
+         high = mid - 1;
+   }
+   if (address >= pending_ranges[low].end)
+      return;
+   // Take it off the list first, in case the symbolizer ends up back here
+   pending_range_t range = pending_ranges[low];
+   memmove(&pending_ranges[low], &pending_ranges[low+1], sizeof(pending_range_t) * (pending_range_count - low - 1));
+   pending_range_count--;
+   range.symbolize(range.context);
+}
+
+// Pending ranges do not overlap, so the last one starting before end is the only one that can reach back past start
+int pending_range_overlaps(uint32_t start, uint32_t end)
+{
+   if (pending_range_count == 0 || pending_ranges[0].start >= end)
+      return 0;
+   uint32_t low = 0;
+   uint32_t high = pending_range_count - 1;
+   while (low < high)
+   {
+      uint32_t mid = low + (high - low + 1) / 2;
+      if (pending_ranges[mid].start < end)
+         low = mid;
+      else
+         high = mid - 1;
+   }
+   return pending_ranges[low].end > start;
+}
+
 int lookup_function(uint32_t address, char** module, char** function)
 {
-   tree_node_t** f = &function_map;
-   while (1)
+   uint32_t i = last_hit;
+   if (!(last_hit_valid && functions_sorted && i + 1 < function_count && functions[i].address <= address && functions[i+1].address > address))
    {
-      if ((*f) == NULL)
+      // Only a miss can be in a range that still has to be symbolized
+      symbolize_pending_range(address);
+      sort_functions();
+      if (function_count < 2)
          return 0;
-      if ((*f)->address > address)
-      {  // Go left 
-         f = &(*f)->left;
-      }
-      else
+      // Binary search for the last function starting at or before the address
+      if (address < functions[0].address)
+         return 0;
+      uint32_t low = 0;
+      uint32_t high = function_count - 1;
+      while (low < high)
       {
-         if ((*f)->right != NULL && ((*f)->right->address > address))
-         {
-            // Found it!
-            *module = (*f)->module;
-            *function = (*f)->function;
-            return 1;
-         }
-         f = &(*f)->right;
+         uint32_t mid = low + (high - low + 1) / 2;
+         if (functions[mid].address <= address)
+            low = mid;
+         else
+            high = mid - 1;
       }
+      // We do not know where the last function ends
+      if (low + 1 == function_count)
+         return 0;
+      i = low;
+      last_hit = i;
+      last_hit_valid = !pending_range_overlaps(functions[i].address, functions[i+1].address);
+   }
+   if (functions[i].function == NULL)
+   {
+      // Only name it once somebody asks
+      char name[16];
+      sprintf(name, "sub_%08x", functions[i].address);
+      functions[i].function = intern(name);
    }
+   *module = (char*)functions[i].module->name;
+   *function = (char*)functions[i].function->name;
+   return 1;
+}
+
+void free_function_map()
+{
+   free(functions);
+   free(pending_ranges);
+   functions = NULL;
+   function_count = 0;
+   function_capacity = 0;
+   functions_sorted = 1;
+   last_hit = 0;
+   last_hit_valid = 0;
+   pending_ranges = NULL;
+   pending_range_count = 0;
+   pending_range_capacity = 0;
+}
+
+void function_map_context(context_t* c)
+{
+   CONTEXT_VAR(c, functions);
+   CONTEXT_VAR(c, function_count);
+   CONTEXT_VAR(c, function_capacity);
+   CONTEXT_VAR(c, functions_sorted);
+   CONTEXT_VAR(c, last_hit);
+   CONTEXT_VAR(c, last_hit_valid);
+   CONTEXT_VAR(c, pending_ranges);
+   CONTEXT_VAR(c, pending_range_count);
+   CONTEXT_VAR(c, pending_range_capacity);
 }
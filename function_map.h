@@ -1,2 +1,6 @@
+#include "intern.h"
 int lookup_function(uint32_t address, char** module, char** function);
-void found_function(char* module, char* function, uint32_t address);
+void found_function(symbol_t module, symbol_t function, uint32_t address);
+void forall_function_entries(uint32_t start, uint32_t end, void (*fn)(uint32_t address, uint8_t thumb));
+void add_pending_functions(uint32_t start, uint32_t end, void (*symbolize)(void*), void* context);
+void free_function_map();
@@ -29,8 +29,7 @@ void configure_hardware()
    // See also https://github.com/darwin-on-arm/xnu/blob/fed9bf4a638f358dd2a8c43a72452fb59914eba0/osfmk/i386/commpage/commpage.c
    // for some hints about 0xffff1020
 
-   unsigned char* arm_tp_data = malloc(4096);   
-   map_memory(arm_tp_data, 0xffff1000, 4096);
+   map_new_memory(0xffff1000, 4096);
    // In reality, the value 0xffff1020 is the CPU capabilities. Report that we have kUP and khasEvent which I assume are a uniprocessor and the WFE instruction
    write_mem(4, 0xffff1020, 0x9000);
 }
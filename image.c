@@ -0,0 +1,241 @@
+// Registry of loaded images. Export tries are not walked up front; instead we descend an image's trie when somebody asks for a symbol
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "machine.h"
+#include "loader.h"
+#include "context.h"
+
+__thread image_t* images = NULL;
+__thread image_t* last_image = NULL;    // Images are kept in load order, since that is the order a flat lookup must search them in
+__thread map_t* image_registry = NULL;  // Every image, under both the name it was loaded by and its install name
+
+image_t* add_image(symbol_t name)
+{
+   image_t* image = calloc(1, sizeof(image_t));
+   image->name = name;
+   if (last_image == NULL)
+      images = image;
+   else
+      last_image->next = image;
+   last_image = image;
+   if (image_registry == NULL)
+      image_registry = alloc_symbol_map(NULL);
+   map_put(image_registry, (void*)name, image);
+   return image;
+}
+
+void set_install_name(image_t* image, symbol_t install_name)
+{
+   void* existing;
+   image->install_name = install_name;
+   // If something else already answers to this name, it was there first
+   if (!map_get(image_registry, (void*)install_name, &existing))
+      map_put(image_registry, (void*)install_name, image);
+}
+
+void add_dependency(image_t* image, symbol_t name, uint8_t reexport)
+{
+   image->dependencies = realloc(image->dependencies, sizeof(dependency_t) * (image->dependency_count + 1));
+   image->dependencies[image->dependency_count].name = name;
+   image->dependencies[image->dependency_count].image = NULL;
+   image->dependencies[image->dependency_count].reexport = reexport;
+   image->dependency_count++;
+}
+
+image_t* find_image_by_install_name(symbol_t name)
+{
+   void* image;
+   if (image_registry == NULL || !map_get(image_registry, (void*)name, &image))
+      return NULL;
+   return image;
+}
+
+// Returns NULL if the ordinal means a flat lookup, or is out of range. A dependency we have not come across yet is registered, so
+// that binds into it have something to wait on
+image_t* image_for_ordinal(image_t* image, uint32_t ordinal)
+{
+   if (ordinal == SELF_LIBRARY_ORDINAL)
+      return image;
+   if (ordinal == EXECUTABLE_ORDINAL)
+      return images;
+   if (ordinal == DYNAMIC_LOOKUP_ORDINAL || ordinal > image->dependency_count)
+      return NULL;
+   dependency_t* dependency = &image->dependencies[ordinal - 1];
+   if (dependency->image == NULL)
+   {
+      dependency->image = find_image_by_install_name(dependency->name);
+      if (dependency->image == NULL)
+         dependency->image = add_image(dependency->name);
+   }
+   return dependency->image;
+}
+
+uint64_t read_trie_uleb(unsigned char** p)
+{
+   uint64_t result = 0;
+   uint8_t shift = 0;
+   uint8_t byte;
+   do
+   {
+      byte = *(*p)++;
+      result |= (uint64_t)(byte & 127) << shift;
+      shift += 7;
+   } while (byte & 128);
+   return result;
+}
+
+// Follow the edges matching the symbol down from the root. Returns the terminal info for the symbol, or NULL if it is not exported
+unsigned char* walk_export_trie(unsigned char* start, unsigned char* end, const char* s)
+{
+   unsigned char* p = start;
+   while (p < end)
+   {
+      uint64_t terminal_size = read_trie_uleb(&p);
+      if (*s == 0 && terminal_size != 0)
+         return p;
+      p += terminal_size;
+      if (p >= end)
+         return NULL;
+      uint8_t child_count = *p++;
+      uint64_t node_offset = 0;
+      for (; child_count > 0; child_count--)
+      {
+         const char* ss = s;
+         uint8_t wrong_edge = 0;
+         // Each edge is a NUL-terminated prefix followed by the offset of the node it leads to
+         for (; *p != 0; p++)
+         {
+            if (!wrong_edge && *p != *ss)
+               wrong_edge = 1;
+            ss++;
+         }
+         p++;
+         uint64_t offset = read_trie_uleb(&p);
+         if (!wrong_edge)
+         {
+            node_offset = offset;
+            s = ss;
+            break;
+         }
+      }
+      if (node_offset == 0)
+         return NULL;
+      p = start + node_offset;
+   }
+   return NULL;
+}
+
+// Re-exports can in principle form cycles, so give up if we find ourselves this deep
+#define MAX_REEXPORT_DEPTH 16
+
+int find_export_at_depth(image_t* image, symbol_t symbol, uint32_t* value, int depth)
+{
+   if (depth > MAX_REEXPORT_DEPTH)
+      return 0;
+   if (image->state == IMAGE_MISSING || (image->state == IMAGE_REGISTERED && !open_image(image)))
+      return 0;
+   void* cached;
+   if (image->resolved != NULL && map_get(image->resolved, (void*)symbol, &cached))
+   {
+      *value = (uint32_t)(uintptr_t)cached;
+      return 1;
+   }
+   unsigned char* p = NULL;
+   if (image->export_trie != NULL)
+      p = walk_export_trie(image->export_trie, image->export_trie + image->export_size, symbol->name);
+   if (p == NULL)
+   {
+      // Not exported directly, but the image may re-export a whole dylib (as libSystem does)
+      for (uint32_t i = 0; i < image->dependency_count; i++)
+      {
+         if (!image->dependencies[i].reexport)
+            continue;
+         image_t* target = image_for_ordinal(image, i + 1);
+         if (target != NULL && find_export_at_depth(target, symbol, value, depth + 1))
+            return 1;
+      }
+      return 0;
+   }
+   uint64_t flags = read_trie_uleb(&p);
+   if ((flags & EXPORT_SYMBOL_FLAGS_REEXPORT) == EXPORT_SYMBOL_FLAGS_REEXPORT)
+   {
+      // The symbol really lives in one of our dependencies, possibly under another name
+      uint64_t ordinal = read_trie_uleb(&p);
+      symbol_t imported_name = (*p == 0)?symbol:intern((char*)p);
+      image_t* target = image_for_ordinal(image, ordinal);
+      return target != NULL && find_export_at_depth(target, imported_name, value, depth + 1);
+   }
+   // Somebody needs a symbol from this image, so if it was only registered, now is the time to bring it in
+   if (image->state != IMAGE_LOADED)
+   {
+      load_image(image);
+      // One of its initializers did not return, so the image is only half there. The bind fails with the machine's stop reason
+      if (machine_stopped(NULL))
+         return 0;
+   }
+   uint64_t address = read_trie_uleb(&p);
+   if ((flags & EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER) == EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER)
+   {
+      // Finally, we know that this symbol needs to have its resolver run. Only do that once
+      uint64_t resolver = read_trie_uleb(&p);
+      printf("      Symbol %s requires a resolver to be run at %016llx, or call the stub at %016llx\n", symbol->name, resolver + image->base_address, address + image->base_address);
+      *value = execute_function(resolver + image->base_address);
+      // Nothing to bind to, and the machine is already on its way out
+      if (machine_stopped(NULL))
+         return 0;
+      if (image->resolved == NULL)
+         image->resolved = alloc_symbol_map(NULL);
+      map_put(image->resolved, (void*)symbol, (void*)(uintptr_t)*value);
+   }
+   else if ((flags & EXPORT_SYMBOL_FLAGS_KIND_MASK) == EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE)
+      *value = address;    // Absolute symbols are plain values, not addresses in the image
+   else
+      *value = address + image->base_address;
+   return 1;
+}
+
+int find_export(image_t* image, symbol_t symbol, uint32_t* value)
+{
+   return find_export_at_depth(image, symbol, value, 0);
+}
+
+int find_any_export(symbol_t symbol, uint32_t* value)
+{
+   for (image_t* image = images; image; image = image->next)
+   {
+      if (find_export(image, symbol, value))
+      {
+         printf("   Found symbol %s in %s at %08x\n", symbol->name, image->name->name, *value);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// The images themselves only. Whatever they point into was mapped by the loader
+void free_images()
+{
+   while (images != NULL)
+   {
+      image_t* image = images;
+      images = image->next;
+      if (image->resolved != NULL)
+         free_map(image->resolved);
+      free(image->dependencies);
+      free(image);
+   }
+   if (image_registry != NULL)
+      free_map(image_registry);
+   image_registry = NULL;
+   last_image = NULL;
+}
+
+void images_context(context_t* c)
+{
+   CONTEXT_VAR(c, images);
+   CONTEXT_VAR(c, last_image);
+   CONTEXT_VAR(c, image_registry);
+}
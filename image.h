@@ -0,0 +1,57 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+#include <stdint.h>
+#include "intern.h"
+#include "map.h"
+
+// Special library ordinals, as found in the bind opcodes and in the n_desc of undefined nlist entries
+#define SELF_LIBRARY_ORDINAL 0x00
+#define DYNAMIC_LOOKUP_ORDINAL 0xfe
+#define EXECUTABLE_ORDINAL 0xff
+
+typedef struct
+{
+   symbol_t name;                // Install name, as given in the LC_LOAD_DYLIB
+   struct image_t* image;        // Filled in the first time a bind goes through this ordinal
+   uint8_t reexport;
+} dependency_t;
+
+typedef enum
+{
+   IMAGE_REGISTERED = 0,    // We know its name, and nothing else
+   IMAGE_MISSING,           // We looked, and could not find it
+   IMAGE_OPENED,            // Headers read, so its exports can be searched, but nothing is mapped
+   IMAGE_LOADED             // Mapped, bound and initialized (or in the process of it)
+} image_state_t;
+
+// Everything we need to remember about an image once its load commands have been processed
+struct image_t
+{
+   symbol_t name;
+   image_state_t state;
+   unsigned char* data;          // The mach header, and the offset of that in the file it came from
+   uint32_t offset;
+   symbol_t install_name;        // From LC_ID_DYLIB. NULL for the main executable
+   unsigned char* export_trie;   // Points into the image's (still mapped) __LINKEDIT
+   uint32_t export_size;
+   uint32_t base_address;        // Address of the mach header. Exports are relative to this
+   uint32_t slide;               // How far the image was moved from where it asked to be loaded
+   dependency_t* dependencies;   // Indexed by library ordinal - 1
+   uint32_t dependency_count;
+   map_t* resolved;              // Results of any resolver functions we have already run
+   struct image_t* next;
+};
+
+typedef struct image_t image_t;
+
+extern __thread image_t* images;    // In load order
+
+image_t* add_image(symbol_t name);
+void set_install_name(image_t* image, symbol_t install_name);
+void add_dependency(image_t* image, symbol_t name, uint8_t reexport);
+image_t* find_image_by_install_name(symbol_t name);
+image_t* image_for_ordinal(image_t* image, uint32_t ordinal);
+int find_export(image_t* image, symbol_t symbol, uint32_t* value);
+int find_any_export(symbol_t symbol, uint32_t* value);
+void free_images();
+#endif
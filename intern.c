@@ -0,0 +1,86 @@
+// String interning table. The strings themselves are packed into a bump arena; the table is an open-addressing hash of pointers into it
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "arena.h"
+#include "context.h"
+
+#define INTERN_ARENA_CHUNK (256 * 1024)
+#define INITIAL_INTERN_TABLE_SIZE 4096   // Must be a power of two
+
+// Each machine has its own table (see machine.h), so symbols from different machines are never the same, even for the same string
+__thread arena_t* intern_arena = NULL;
+__thread symbol_t* intern_table = NULL;
+__thread uint32_t intern_table_size = 0;
+__thread uint32_t intern_count = 0;
+
+void grow_intern_table()
+{
+   symbol_t* old_table = intern_table;
+   uint32_t old_size = intern_table_size;
+   intern_table_size = (old_size == 0)?INITIAL_INTERN_TABLE_SIZE:(old_size * 2);
+   intern_table = calloc(sizeof(symbol_t), intern_table_size);
+   for (uint32_t j = 0; j < old_size; j++)
+   {
+      if (old_table[j] == NULL)
+         continue;
+      uint32_t i = old_table[j]->hash & (intern_table_size - 1);
+      while (intern_table[i] != NULL)
+         i = (i + 1) & (intern_table_size - 1);
+      intern_table[i] = old_table[j];
+   }
+   free(old_table);
+}
+
+symbol_t intern_n(const char* name, size_t length)
+{
+   // djb2, as used by alloc_char_map()
+   uint32_t hash = 5381;
+   for (size_t j = 0; j < length; j++)
+      hash = ((hash << 5) + hash) + (unsigned char)name[j];
+   // Keep the load factor under a half
+   if ((intern_count + 1) * 2 > intern_table_size)
+      grow_intern_table();
+   uint32_t mask = intern_table_size - 1;
+   uint32_t i = hash & mask;
+   for (; intern_table[i] != NULL; i = (i + 1) & mask)
+   {
+      symbol_t s = intern_table[i];
+      if (s->hash == hash && s->length == length && memcmp(s->name, name, length) == 0)
+         return s;
+   }
+   if (intern_arena == NULL)
+      intern_arena = alloc_arena(INTERN_ARENA_CHUNK);
+   interned_t* s = arena_alloc(intern_arena, sizeof(interned_t) + length + 1);
+   s->hash = hash;
+   s->length = length;
+   memcpy(s->name, name, length);
+   s->name[length] = 0;
+   intern_table[i] = s;
+   intern_count++;
+   return s;
+}
+
+symbol_t intern(const char* name)
+{
+   return intern_n(name, strlen(name));
+}
+
+void free_interned_strings()
+{
+   if (intern_arena)
+      free_arena(intern_arena);
+   free(intern_table);
+   intern_arena = NULL;
+   intern_table = NULL;
+   intern_table_size = 0;
+   intern_count = 0;
+}
+
+void intern_context(context_t* c)
+{
+   CONTEXT_VAR(c, intern_arena);
+   CONTEXT_VAR(c, intern_table);
+   CONTEXT_VAR(c, intern_table_size);
+   CONTEXT_VAR(c, intern_count);
+}
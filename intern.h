@@ -0,0 +1,20 @@
+#ifndef INTERN_H
+#define INTERN_H
+#include <stdint.h>
+#include <stddef.h>
+
+// An interned string. There is exactly one of these for any given sequence of characters, so two symbols are equal
+// if and only if their pointers are equal. They live until free_interned_strings() is called
+typedef struct
+{
+   uint32_t hash;
+   uint32_t length;
+   char name[];
+} interned_t;
+
+typedef const interned_t* symbol_t;
+
+symbol_t intern(const char* name);
+symbol_t intern_n(const char* name, size_t length);
+void free_interned_strings();
+#endif
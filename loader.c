@@ -4,7 +4,16 @@
 #include "symtab.h"
 #include "dyld_cache.h"
 #include "function_map.h"
+#include "image.h"
+#include "arena.h"
+#include "coverage.h"
+#include "context.h"
 #include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 //#define printf(...) (void)0
 
@@ -48,6 +57,16 @@
 #define BIND_DO_BIND_ADD_ADDR_IMM_SCALED 0xB
 #define BIND_DO_BIND_ULEB_TIMES_SKIPPING_ULEB 0xC
 
+#define REBASE_DONE 0x0
+#define REBASE_SET_TYPE_IMM 0x1
+#define REBASE_SET_SEGMENT_AND_OFFSET_ULEB 0x2
+#define REBASE_ADD_ADDR_ULEB 0x3
+#define REBASE_ADD_ADDR_IMM_SCALED 0x4
+#define REBASE_DO_REBASE_IMM_TIMES 0x5
+#define REBASE_DO_REBASE_ULEB_TIMES 0x6
+#define REBASE_DO_REBASE_ADD_ADDR_ULEB 0x7
+#define REBASE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB 0x8
+
 
 #define BREAK32 0xe1200070
 #define BREAK16 0x00be
@@ -91,23 +110,32 @@ uint64_t read_uleb_integer(unsigned char** p)
 }
 
 
-struct segment_list_t
+// Where the segments and sections of an image ended up. These are only needed while the image is being loaded, so they are kept
+// in the loader arena. Segments are numbered from 0 and sections from 1 (as the load commands have them), so sections[0] is #1
+typedef struct
 {
-   int segment_number;
    uint32_t base_address;
-   struct segment_list_t* next;   
-};
-typedef struct segment_list_t segment_list_t;
+} segment_t;
 
-struct section_list_t
+typedef struct
 {
-   int section_number;
    uint32_t base_address;
    uint32_t flags;
    uint32_t size;
-   struct section_list_t* next;   
-};
-typedef struct section_list_t section_list_t;
+   uint32_t reserved1;
+   unsigned char* data;
+} section_t;
+
+typedef struct
+{
+   segment_t* segments;
+   uint32_t segment_count;
+   section_t* sections;
+   uint32_t section_count;
+} layout_t;
+
+#define LOADER_ARENA_CHUNK (64 * 1024)
+__thread arena_t* loader_arena = NULL;
 
 
 typedef struct
@@ -118,50 +146,101 @@ typedef struct
    uint64_t offset;
    uint8_t segment;
    int32_t addend;
-   char* name;
+   symbol_t name;
 } sym_t;
 
 
-uint32_t next_break = 0xa0000000;
-map_t* breakpoints = NULL;
+__thread uint32_t next_break = 0xa0000000;
+__thread int_map_t* breakpoints = NULL;
+uint8_t bind_lazily = 1;
 
-void register_stub(char* stub_name, uint32_t(_stub)())
+breakpoint_t* add_breakpoint(symbol_t symbol, uint32_t(_stub)(), uint32_t* address)
 {
    // Make a breakpoint. Not sure where to put this, so lets just say we start at 0xa0000000?
    if (next_break % VPAGE_SIZE == 0)
-   {
-      unsigned char* page = malloc(VPAGE_SIZE);
-      map_memory(page, next_break, VPAGE_SIZE);
-   }
+      map_new_memory(next_break, VPAGE_SIZE);
    write_mem(4, next_break, BREAK32);
-   found_symbol(stub_name, next_break);
    breakpoint_t* breakpoint = malloc(sizeof(breakpoint_t));
-   breakpoint->symbol_name = strdup(stub_name);
+   breakpoint->symbol = symbol;
    breakpoint->handler = _stub;
-   uint32_t* key = malloc(sizeof(uint32_t));
-   *key = next_break;
-   map_put(breakpoints, key, breakpoint);
+   breakpoint->lazy_pointer = 0;
+   breakpoint->image = NULL;
+   int_map_put(breakpoints, next_break, breakpoint);
+   *address = next_break;
    next_break += 4;
+   return breakpoint;
+}
+
+void register_stub(char* stub_name, uint32_t(_stub)())
+{
+   uint32_t address;
+   symbol_t symbol = intern(stub_name);
+   add_breakpoint(symbol, _stub, &address);
+   found_symbol(symbol, address);
 }
 
+// Rather than binding a lazy pointer now, aim it at a breakpoint of its own. The first call through it lands in bind_lazy_pointer(),
+// which does the work dyld_stub_binder would do. Symbols that are never called are never looked up
+void need_lazy_symbol(symbol_t symbol, uint32_t lazy_pointer, image_t* image, uint32_t ordinal)
+{
+   if (!bind_lazily)
+   {
+      need_symbol(symbol, lazy_pointer, image, ordinal);
+      return;
+   }
+   uint32_t trampoline;
+   breakpoint_t* breakpoint = add_breakpoint(symbol, NULL, &trampoline);
+   breakpoint->lazy_pointer = lazy_pointer;
+   breakpoint->image = image;
+   breakpoint->ordinal = ordinal;
+   write_mem(4, lazy_pointer, trampoline);
+}
 
-uint32_t current_page_offset = 0;
+// Puts a trampoline back exactly where it was when a snapshot was taken. The guest memory it lives in is restored separately
+void restore_lazy_breakpoint(uint32_t address, symbol_t symbol, uint32_t lazy_pointer, image_t* image, uint32_t ordinal)
+{
+   breakpoint_t* breakpoint = malloc(sizeof(breakpoint_t));
+   breakpoint->symbol = symbol;
+   breakpoint->handler = NULL;
+   breakpoint->lazy_pointer = lazy_pointer;
+   breakpoint->image = image;
+   breakpoint->ordinal = ordinal;
+   int_map_put(breakpoints, address, breakpoint);
+}
 
-void bind_sym(char* current_file, segment_list_t* segment_list, sym_t* sym)
+int bind_lazy_pointer(breakpoint_t* breakpoint, uint32_t* target)
 {
-   uint32_t address = 0;
-   for (segment_list_t* node = segment_list; node; node = node->next)
+   if (!resolve_symbol(breakpoint->image, breakpoint->ordinal, breakpoint->symbol, target))
    {
-      if (node->segment_number == sym->segment)
-      {
-         address = sym->offset + node->base_address;
-         break;
-      }
+      printf("   *** Lazy binding failed: %s is not defined\n", breakpoint->symbol->name);
+      return 0;
    }
-   need_symbol(sym->name, address);
+   printf("   Lazily bound %s to %08x (via %08x)\n", breakpoint->symbol->name, *target, breakpoint->lazy_pointer);
+   // Patch the pointer so later calls go straight to the target
+   write_mem(4, breakpoint->lazy_pointer, *target);
+   return 1;
 }
 
-void bind_symbols(char* current_file, segment_list_t* segment_list, char* mode, unsigned char* start, unsigned char* end)
+
+__thread uint32_t current_page_offset = 0;
+
+uint32_t segment_address(layout_t* layout, int segment_number)
+{
+   if (segment_number >= layout->segment_count)
+      return 0;
+   return layout->segments[segment_number].base_address;
+}
+
+void bind_sym(image_t* image, layout_t* layout, sym_t* sym)
+{
+   uint32_t address = sym->offset + segment_address(layout, sym->segment);
+   if (strcmp(sym->mode, "lazy") == 0)
+      need_lazy_symbol(sym->name, address, image, sym->library_ordinal);
+   else
+      need_symbol(sym->name, address, image, sym->library_ordinal);
+}
+
+void bind_symbols(image_t* image, layout_t* layout, char* mode, unsigned char* start, unsigned char* end)
 {
    unsigned char* op;
    sym_t sym;
@@ -189,10 +268,8 @@ void bind_symbols(char* current_file, segment_list_t* segment_list, char* mode,
          {
             // flags are in the low nibble
             op++;
-            if (sym.name)
-               free(sym.name);
-            sym.name = strdup((const char*)op);
-            op += strlen(sym.name);
+            sym.name = intern((const char*)op);
+            op += sym.name->length;
             break;
          }
          case BIND_SET_TYPE_IMM:
@@ -206,15 +283,15 @@ void bind_symbols(char* current_file, segment_list_t* segment_list, char* mode,
             sym.addend = read_sleb_integer(&op);
             break;
          case BIND_DO_BIND:
-            bind_sym(current_file, segment_list, &sym);
+            bind_sym(image, layout, &sym);
             sym.offset += 4;
             break;
          case BIND_DO_BIND_ADD_ADDR_ULEB:
-            bind_sym(current_file, segment_list, &sym);
+            bind_sym(image, layout, &sym);
             sym.offset += 4 + read_uleb_integer(&op);
             break;
          case BIND_DO_BIND_ADD_ADDR_IMM_SCALED:
-            bind_sym(current_file, segment_list, &sym);
+            bind_sym(image, layout, &sym);
             sym.offset += 4 + (4 * ((*op) & 15));
             break;                     
          case BIND_ADD_ADDR_ULEB:
@@ -229,7 +306,7 @@ void bind_symbols(char* current_file, segment_list_t* segment_list, char* mode,
             uint32_t skip = read_uleb_integer(&op);
             for (int j = 0; j < count; j++)
             {
-               bind_sym(current_file, segment_list, &sym);
+               bind_sym(image, layout, &sym);
                sym.offset += 4 + skip;
             }
          }
@@ -241,149 +318,634 @@ void bind_symbols(char* current_file, segment_list_t* segment_list, char* mode,
    }
 }
 
-char* sim_chroot = "armv7_5";
+#define DEFAULT_SEARCH_ROOT "armv7_5"
+
+// Install names are looked for under each of these in turn. They are shared by every machine, so must be set up before the first one
+char** search_roots = NULL;
+uint32_t search_root_count = 0;
+// Where each install name turned up on disk. A NULL path means it is in none of the search roots, so we do not look again
+__thread map_t* dylib_paths = NULL;
 
-char* find_dylib(char* base, char* suggested_path)
+void add_search_root(char* root)
 {
-   char* filename = malloc(strlen(suggested_path) + strlen(sim_chroot) + 2);
-   sprintf(filename, "%s%s", sim_chroot, suggested_path);
-   if (access(filename, F_OK ) != -1)
-      return filename;
-   printf("Failed to find file at %s\n", filename);
-   free(filename);
-   return NULL;
+   search_roots = realloc(search_roots, sizeof(char*) * (search_root_count + 1));
+   search_roots[search_root_count++] = root;
 }
 
-struct loaded_dylib_t
+// The returned path belongs to the path cache, and must not be freed
+char* find_dylib(symbol_t install_name)
 {
-   struct loaded_dylib_t* next;
-   char* dylib_name;
-};
+   void* path;
+   if (dylib_paths == NULL)
+      dylib_paths = alloc_symbol_map(free);
+   if (map_get(dylib_paths, (void*)install_name, &path))
+      return path;
+   if (search_root_count == 0)
+      add_search_root(DEFAULT_SEARCH_ROOT);
+   path = NULL;
+   for (uint32_t i = 0; i < search_root_count && path == NULL; i++)
+   {
+      char* filename = malloc(strlen(install_name->name) + strlen(search_roots[i]) + 1);
+      sprintf(filename, "%s%s", search_roots[i], install_name->name);
+      if (access(filename, F_OK ) != -1)
+         path = filename;
+      else
+         free(filename);
+   }
+   if (path == NULL)
+      printf("Failed to find %s in any search root\n", install_name->name);
+   map_put(dylib_paths, (void*)install_name, path);
+   return path;
+}
+
+void parse_image(image_t* image, unsigned char* data, uint32_t offset);
 
-typedef struct loaded_dylib_t loaded_dylib_t;
-loaded_dylib_t* loaded_dylibs = NULL;
+// Counts images as they are loaded, so load_remaining_dylibs() can tell when there might be something new to do
+__thread uint32_t images_loaded = 0;
+__thread uint32_t images_loaded_when_complete = 0;
 
-int load_dylib(char* base, char* filename)
+int load_dylib(symbol_t install_name);
+
+void load_dependencies_of(image_t* image)
 {
-   // First mark it as loaded to avoid cycles
-   loaded_dylib_t* x = malloc(sizeof(loaded_dylib_t));
-   x->dylib_name = strdup(filename);
-   x->next = loaded_dylibs;
-   loaded_dylibs = x;
-   
-   if (try_cache(filename))
-      return 1;
-   
-   char* dylib_name = find_dylib(base, filename);
-   if (dylib_name != NULL)
+   for (uint32_t i = 0; i < image->dependency_count; i++)
    {
-      printf("Found at %s\n", dylib_name);
-      load_executable(dylib_name);
-      free(dylib_name);
-      return 1;
+      image_t* dependency = find_image_by_install_name(image->dependencies[i].name);
+      if (dependency != NULL && (dependency->state == IMAGE_LOADED || dependency->state == IMAGE_MISSING))
+         continue;
+      if (load_dylib(image->dependencies[i].name))
+         load_dependencies_of(find_image_by_install_name(image->dependencies[i].name));
    }
-   else
+}
+
+// With --lazy-dylibs, brings in everything that has not been loaded yet, as if it had been loaded up front
+void load_remaining_dylibs()
+{
+   if (images_loaded == images_loaded_when_complete)
+      return;
+   for (image_t* image = images; image != NULL; image = image->next)
+   {
+      if (image->state == IMAGE_LOADED)
+         load_dependencies_of(image);
+   }
+   images_loaded_when_complete = images_loaded;
+}
+
+int load_dylib(symbol_t install_name)
+{
+   image_t* image = find_image_by_install_name(install_name);
+   if (image == NULL)
+      image = add_image(install_name);
+   if (image->state == IMAGE_LOADED)
+      return 1;
+   if (image->state == IMAGE_MISSING || (image->state == IMAGE_REGISTERED && !open_image(image)))
    {
       printf("Failed to find dylib\n");
       return 0;
    }
+   parse_image(image, image->data, image->offset);
+   return 1;
 }
 
 
 #define byteswap32(x) ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) | (((x) & 0x0000ff00) <<  8) | (((x) & 0x000000ff) << 24))
 
-void free_segment_list(segment_list_t* segment_list)
+uint8_t load_dylibs_lazily = 0;
+
+int compare_addresses(const void* a, const void* b)
+{
+   uint32_t x = *(uint32_t*)a;
+   uint32_t y = *(uint32_t*)b;
+   return (x > y) - (x < y);
+}
+
+// Rebasing is done in two passes: the opcodes are decoded into a list of addresses, and then the slide is added to each one.
+// The list is nearly always in address order, so the second pass only has to find the host memory (and do what write_mem would
+// have done for it) once per page
+void rebase_image(layout_t* layout, unsigned char* start, unsigned char* end, uint32_t slide)
 {
-   for(segment_list_t* x = segment_list; x;)
+   uint32_t* addresses = NULL;
+   uint32_t count = 0;
+   uint32_t capacity = 0;
+   uint8_t sorted = 1;
+   uint32_t segment_base = 0;
+   uint64_t offset = 0;
+   unsigned char* op;
+   for(op = start; op < end; op++)
    {
-      segment_list_t* y = x->next;
-      free(x);
-      x = y;
+      uint32_t times = 1;
+      uint64_t skip = 0;
+      switch(((*op) >> 4) & 15)
+      {
+         case REBASE_DONE:
+            continue;
+         case REBASE_SET_TYPE_IMM:
+            // On a 32 bit target, both kinds of absolute pointer are fixed up the same way
+            assert(((*op) & 15) == REBASE_TYPE_POINTER || ((*op) & 15) == REBASE_TYPE_TEXT_ABSOLUTE32);
+            continue;
+         case REBASE_SET_SEGMENT_AND_OFFSET_ULEB:
+            segment_base = segment_address(layout, (*op) & 15);
+            offset = read_uleb_integer(&op);
+            continue;
+         case REBASE_ADD_ADDR_ULEB:
+            offset += read_uleb_integer(&op);
+            continue;
+         case REBASE_ADD_ADDR_IMM_SCALED:
+            offset += 4 * ((*op) & 15);
+            continue;
+         case REBASE_DO_REBASE_IMM_TIMES:
+            times = (*op) & 15;
+            break;
+         case REBASE_DO_REBASE_ULEB_TIMES:
+            times = read_uleb_integer(&op);
+            break;
+         case REBASE_DO_REBASE_ADD_ADDR_ULEB:
+            skip = read_uleb_integer(&op);
+            break;
+         case REBASE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB:
+            times = read_uleb_integer(&op);
+            skip = read_uleb_integer(&op);
+            break;
+         default:
+            printf("Rebase opcode not implemented: %d\n", ((*op) >> 4));
+            assert(0);
+      }
+      if (count + times > capacity)
+      {
+         while (count + times > capacity)
+            capacity = (capacity == 0)?1024:(capacity * 2);
+         addresses = realloc(addresses, sizeof(uint32_t) * capacity);
+      }
+      for (uint32_t j = 0; j < times; j++)
+      {
+         uint32_t address = segment_base + offset;
+         if (count > 0 && address < addresses[count-1])
+            sorted = 0;
+         addresses[count++] = address;
+         offset += 4 + skip;
+      }
+   }
+   if (!sorted)
+      qsort(addresses, count, sizeof(uint32_t), compare_addresses);
+   unsigned char* window = NULL;
+   uint32_t window_start = 0;
+   uint32_t window_length = 0;
+   for (uint32_t i = 0; i < count; i++)
+   {
+      uint32_t address = addresses[i];
+      if (window == NULL || address < window_start || address - window_start + 4 > window_length)
+      {
+         if (window != NULL)
+            range_written(window_start);
+         window_start = address;
+         window = map_range_for_write(address, &window_length);
+         if (window == NULL || window_length < 4)
+         {
+            // Straddles a page (or the page is shared with another region), so let write_mem sort it out
+            write_mem(4, address, read_mem(4, address) + slide);
+            window = NULL;
+            continue;
+         }
+      }
+      unsigned char* p = &window[address - window_start];
+      uint32_t value;
+      memcpy(&value, p, 4);
+      value += slide;
+      memcpy(p, &value, 4);
    }
+   if (window != NULL)
+      range_written(window_start);
+   printf("Rebased %d pointers by %08x\n", count, slide);
+   free(addresses);
 }
 
-void free_section_list(section_list_t* section_list)
+// Images normally go where they ask to be. One that would land on top of something already mapped is moved up here instead,
+// which is only possible if it has rebase info to fix up its pointers
+#define RELOCATED_IMAGE_BASE 0x60000000
+#define RELOCATED_IMAGE_LIMIT 0x80000000
+__thread uint32_t next_relocated_image = RELOCATED_IMAGE_BASE;
+
+uint32_t choose_slide(image_t* image)
 {
-   for(section_list_t* x = section_list; x;)
+   struct mach_header* header = (struct mach_header*)image->data;
+   struct load_command* command = (struct load_command*)(image->data + sizeof(struct mach_header));
+   uint32_t low = 0xffffffff;
+   uint32_t high = 0;
+   uint32_t rebase_size = 0;
+   for (int i = 0; i < header->ncmds; i++)
+   {
+      if (command->cmd == LC_SEGMENT)
+      {
+         struct segment_command* c = (struct segment_command*)command;
+         // __PAGEZERO takes up address space, but nothing is ever mapped there
+         if (c->vmsize != 0 && !(c->filesize == 0 && c->initprot == 0))
+         {
+            if (c->vmaddr < low)
+               low = c->vmaddr;
+            if (c->vmaddr + c->vmsize > high)
+               high = c->vmaddr + c->vmsize;
+         }
+      }
+      else if (command->cmd == LC_DYLD_INFO_ONLY || command->cmd == LC_DYLD_INFO)
+         rebase_size = ((struct dyld_info_command*)command)->rebase_size;
+      command = (struct load_command*)((char*)command + command->cmdsize);
+   }
+   if (low >= high || !range_is_mapped(low, high - low))
+      return 0;
+   if (rebase_size == 0)
    {
-      section_list_t* y = x->next;
-      free(x);
-      x = y;
+      printf("%s overlaps memory that is already mapped, but has no rebase info so cannot be moved\n", image->name->name);
+      return 0;
    }
+   uint32_t base = next_relocated_image;
+   next_relocated_image = (base + (high - low) + VPAGE_SIZE - 1) & ~(VPAGE_SIZE - 1);
+   assert(next_relocated_image <= RELOCATED_IMAGE_LIMIT);
+   printf("%s overlaps memory that is already mapped, so it is being moved from %08x to %08x\n", image->name->name, low, base);
+   return base - low;
 }
 
-void parse_export_tree(unsigned char* trie_root, unsigned char* trie, unsigned char* trie_end, unsigned char* buffer, unsigned char* root_buffer, uint64_t base_address)
+// The parts of the load commands that are needed to look up exports: enough to decide whether an image is worth loading. Reading them
+// touches nothing shared, so the loader threads can do it; only applying them to an image (which interns the names) cannot be
+typedef struct
+{
+   uint8_t has_text;
+   uint32_t base_address;
+   uint8_t has_exports;
+   uint32_t export_off;          // In the file, so still relative to the start of any universal binary
+   uint32_t export_size;
+   char* install_name;           // The names all point into the load commands
+   char** dependencies;
+   uint8_t* reexports;
+   uint32_t dependency_count;
+} image_headers_t;
+
+void read_image_headers(unsigned char* data, image_headers_t* headers)
 {
-   assert(trie < trie_end);
-   uint8_t terminal_size = *trie;
-   if (terminal_size > 127)
-      assert(0);
-   if (terminal_size != 0)
+   struct mach_header* header = (struct mach_header*)data;
+   struct load_command* command = (struct load_command*)(data + sizeof(struct mach_header));
+   memset(headers, 0, sizeof(image_headers_t));
+   headers->dependencies = malloc(sizeof(char*) * header->ncmds);
+   headers->reexports = malloc(header->ncmds);
+   for (int i = 0; i < header->ncmds; i++)
    {
-      // This is a terminal
-      uint64_t flags = read_uleb_integer(&trie);
-      printf("Terminal: >%s< flags %016llx\n", root_buffer, flags);
-      if ((flags & EXPORT_SYMBOL_FLAGS_REEXPORT) == EXPORT_SYMBOL_FLAGS_REEXPORT)
+      switch(command->cmd)
       {
-         // FIXME: Not implemented
-         return;
+         case LC_SEGMENT:
+         {
+            struct segment_command* c = (struct segment_command*)command;
+            if (strcmp(c->segname, "__TEXT") == 0)
+            {
+               headers->has_text = 1;
+               headers->base_address = c->vmaddr;
+            }
+            break;
+         }
+         case LC_DYLD_INFO_ONLY:
+         {
+            // Exports are looked up in the trie as and when they are needed
+            struct dyld_info_command* c = (struct dyld_info_command*)command;
+            headers->has_exports = 1;
+            headers->export_off = c->export_off;
+            headers->export_size = c->export_size;
+            break;
+         }
+         case LC_ID_DYLIB:
+         {
+            struct dylib_command* c = (struct dylib_command*)command;
+            headers->install_name = ((char*)command) + c->dylib.name.offset;
+            break;
+         }
+         case LC_REEXPORT_DYLIB:
+         case LC_LOAD_WEAK_DYLIB:
+         case LC_LOAD_DYLIB:
+         {
+            // The order of these commands is what gives each library its ordinal
+            struct dylib_command* c = (struct dylib_command*)command;
+            headers->reexports[headers->dependency_count] = (command->cmd == LC_REEXPORT_DYLIB);
+            headers->dependencies[headers->dependency_count++] = ((char*)command) + c->dylib.name.offset;
+            break;
+         }
       }
-      uint64_t address = read_uleb_integer(&trie);
-      if ((flags & EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER) == EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER)
+      command = (struct load_command*)((char*)command + command->cmdsize);
+   }
+}
+
+void apply_image_headers(image_t* image, image_headers_t* headers)
+{
+   if (headers->has_text)
+      image->base_address = headers->base_address;
+   if (headers->has_exports)
+   {
+      image->export_trie = &image->data[headers->export_off - image->offset];
+      image->export_size = headers->export_size;
+   }
+   if (headers->install_name != NULL)
+      set_install_name(image, intern(headers->install_name));
+   for (uint32_t i = 0; i < headers->dependency_count; i++)
+      add_dependency(image, intern(headers->dependencies[i]), headers->reexports[i]);
+   image->state = IMAGE_OPENED;
+}
+
+void free_image_headers(image_headers_t* headers)
+{
+   free(headers->dependencies);
+   free(headers->reexports);
+}
+
+void scan_image_headers(image_t* image)
+{
+   image_headers_t headers;
+   assert(((struct mach_header*)image->data)->magic == MH_MAGIC);
+   read_image_headers(image->data, &headers);
+   apply_image_headers(image, &headers);
+   free_image_headers(&headers);
+}
+
+unsigned char* read_executable(char* filename);
+void note_mapped_file(char* filename, unsigned char* data, size_t length);
+unsigned char* arm_slice(unsigned char* data);
+
+// Files that were opened ahead of time by prepare_dependencies(), by install name. NULL if it was not found (or is in the cache)
+typedef struct
+{
+   unsigned char* data;
+   image_headers_t headers;
+} prepared_image_t;
+
+__thread map_t* prepared_images = NULL;
+
+void free_prepared_image(void* ptr)
+{
+   prepared_image_t* prepared = ptr;
+   if (prepared == NULL)
+      return;
+   free_image_headers(&prepared->headers);
+   free(prepared);
+}
+
+// Find the file for an image that has so far only been registered by name, and read its headers. Nothing is mapped yet
+int open_image(image_t* image)
+{
+   unsigned char* data;
+   uint32_t offset = 0;
+   prepared_image_t* prepared;
+   if (prepared_images != NULL && map_get(prepared_images, (void*)image->name, (void**)&prepared) && prepared != NULL)
+   {
+      // A loader thread has already been through the load commands
+      printf("Already opened %s\n", image->name->name);
+      image->data = prepared->data;
+      image->offset = 0;
+      apply_image_headers(image, &prepared->headers);
+      return 1;
+   }
+   if (!find_in_cache((char*)image->name->name, &data, &offset))
+   {
+      char* path = find_dylib(image->name);
+      if (path == NULL)
       {
-         // Finally, we know that this symbol needs to have its resolver run
-         uint64_t resolver = read_uleb_integer(&trie);
-         printf("      Symbol requires a resolver to be run at %016llx, or call the stub at %016llx\n", resolver + base_address, address + base_address);
-         // Run resolver here and advise that we have found a symbol by calling found_symbol.
-         uint32_t resolved = execute_function(resolver+base_address);
-         found_symbol((char*)root_buffer, resolved);
+         image->state = IMAGE_MISSING;
+         return 0;
       }
-      else
+      printf("Found at %s\n", path);
+      data = read_executable(path);
+      if (data == NULL)
       {
-         // advise that we have found a symbol by calling found_symbol.
-         found_symbol((char*)root_buffer, address+base_address);
+         image->state = IMAGE_MISSING;
+         return 0;
       }
    }
-   else
+   image->data = data;
+   image->offset = offset;
+   scan_image_headers(image);
+   return 1;
+}
+
+double milliseconds_since(struct timespec* start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// With --loader-threads, the files for every dylib the executable needs are opened, and their load commands read, before any of them
+// is loaded. That is mostly waiting on the disk, and touches nothing shared, so it is done in parallel a level of the dependency graph
+// at a time. Loading proper (mapping, binding and initializing) still happens in exactly the same order as it would otherwise. The
+// workers cannot see the machine (it belongs to the thread loading it), so everything they find is handed back in the job
+uint32_t loader_threads = 0;
+
+typedef struct
+{
+   symbol_t name;
+   char* path;
+   unsigned char* file;          // The whole file, which is noted as mapped once the workers are done
+   size_t file_length;
+   unsigned char* data;
+   image_headers_t headers;
+   double milliseconds;          // Spent on this job, so the time saved can be compared with the time the threads took
+} prepare_job_t;
+
+typedef struct
+{
+   prepare_job_t* jobs;
+   uint32_t count;
+   uint32_t next;
+} prepare_batch_t;
+
+void prepare_image(prepare_job_t* job)
+{
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   job->file = map_whole_file(job->path, &job->file_length);
+   job->data = arm_slice(job->file);
+   memset(&job->headers, 0, sizeof(image_headers_t));
+   // Left for open_image() to find missing, the same as without --loader-threads
+   if (job->data != NULL)
    {
-      trie++;
-      uint8_t child_count = *trie++;
-      unsigned char* tmp = buffer;
-      for (int i = 0; i < child_count; i++)
+      read_image_headers(job->data, &job->headers);
+      struct mach_header* header = (struct mach_header*)job->data;
+      struct load_command* command = (struct load_command*)(job->data + sizeof(struct mach_header));
+      for (int i = 0; i < header->ncmds; i++)
       {
-         buffer = tmp;
-         while(*trie)
+         if (command->cmd == LC_SEGMENT && strcmp(((struct segment_command*)command)->segname, "__LINKEDIT") == 0)
          {
-            *buffer++ = *trie++;
+            // Fault in the symbols, export trie and binding opcodes now, rather than one page at a time while loading
+            struct segment_command* c = (struct segment_command*)command;
+            volatile unsigned char touch;
+            for (uint32_t j = 0; j < c->filesize; j += VPAGE_SIZE)
+               touch = job->data[c->fileoff + j];
+            (void)touch;
          }
-         *buffer = *trie;
-         uint64_t offset = read_uleb_integer(&trie);
-         trie++;
-         assert(offset != 0);
-         parse_export_tree(trie_root, trie_root + offset, trie_end, buffer, root_buffer, base_address);
-      }      
+         command = (struct load_command*)((char*)command + command->cmdsize);
+      }
    }
+   job->milliseconds = milliseconds_since(&start);
+}
+
+void* prepare_worker(void* context)
+{
+   prepare_batch_t* batch = context;
+   uint32_t i;
+   while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count)
+      prepare_image(&batch->jobs[i]);
+   return NULL;
+}
+
+void prepare_dependencies(image_t* root)
+{
+   struct timespec start;
+   prepare_batch_t batch;
+   uint32_t total = 0;
+   double busy = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   prepared_images = alloc_symbol_map(free_prepared_image);
+   symbol_t* level = malloc(sizeof(symbol_t) * root->dependency_count);
+   uint32_t level_count = root->dependency_count;
+   for (uint32_t i = 0; i < level_count; i++)
+      level[i] = root->dependencies[i].name;
+   while (level_count > 0)
+   {
+      // Work out which of this level still need opening. Only this thread ever looks at the maps
+      void* unused;
+      unsigned char* data;
+      uint32_t offset;
+      batch.jobs = malloc(sizeof(prepare_job_t) * level_count);
+      batch.count = 0;
+      batch.next = 0;
+      for (uint32_t i = 0; i < level_count; i++)
+      {
+         if (map_get(prepared_images, (void*)level[i], &unused) || find_image_by_install_name(level[i]) != NULL)
+            continue;
+         map_put(prepared_images, (void*)level[i], NULL);
+         // Things in the shared cache are already mapped, and only ever depend on other things in the cache
+         if (find_in_cache((char*)level[i]->name, &data, &offset))
+            continue;
+         char* path = find_dylib(level[i]);
+         if (path == NULL)
+            continue;
+         batch.jobs[batch.count].name = level[i];
+         batch.jobs[batch.count].path = path;
+         batch.count++;
+      }
+      uint32_t thread_count = (batch.count < loader_threads)?batch.count:loader_threads;
+      pthread_t* threads = malloc(sizeof(pthread_t) * thread_count);
+      uint32_t started = 0;
+      while (started < thread_count && pthread_create(&threads[started], NULL, prepare_worker, &batch) == 0)
+         started++;
+      // Any jobs left over are done here instead. There is always at least this thread
+      if (started < thread_count)
+         prepare_worker(&batch);
+      for (uint32_t i = 0; i < started; i++)
+         pthread_join(threads[i], NULL);
+      free(threads);
+      // Everything they depend on makes up the next level
+      free(level);
+      level_count = 0;
+      for (uint32_t i = 0; i < batch.count; i++)
+         level_count += batch.jobs[i].headers.dependency_count;
+      level = malloc(sizeof(symbol_t) * level_count);
+      level_count = 0;
+      for (uint32_t i = 0; i < batch.count; i++)
+      {
+         prepare_job_t* job = &batch.jobs[i];
+         busy += job->milliseconds;
+         if (job->file != NULL)
+            note_mapped_file(job->path, job->file, job->file_length);
+         for (uint32_t j = 0; j < job->headers.dependency_count; j++)
+            level[level_count++] = intern(job->headers.dependencies[j]);
+         if (job->data == NULL)
+            continue;
+         prepared_image_t* prepared = malloc(sizeof(prepared_image_t));
+         prepared->data = job->data;
+         prepared->headers = job->headers;
+         map_put(prepared_images, (void*)job->name, prepared);
+      }
+      total += batch.count;
+      free(batch.jobs);
+   }
+   free(level);
+   printf("Opened %d dylibs on up to %d threads in %.3fms (%.3fms of work)\n", total, loader_threads, milliseconds_since(&start), busy);
+}
+
+// A list of ULEB deltas between the starts of functions (with the Thumb bit), starting from __TEXT and ending with a 0. Functions that
+// are not in the symbol table are still in here
+void report_function_starts(image_t* image, unsigned char* p, uint32_t size)
+{
+   unsigned char* end = p + size;
+   uint32_t address = image->base_address;
+   uint32_t count = 0;
+   // read_uleb_integer() expects to be pointing at the byte before the number, and leaves us at the last byte of it
+   for (p--; p + 1 < end && p[1] != 0;)
+   {
+      address += read_uleb_integer(&p);
+      found_function(image->name, NULL, address);
+      count++;
+   }
+   printf("Function start table lists %d functions\n", count);
+}
+
+__thread section_t* predecode_section = NULL;
+
+void predecode_entry(uint32_t address, uint8_t thumb)
+{
+   predecode(address, thumb, predecode_section->data, predecode_section->base_address, predecode_section->size);
 }
 
 void parse_executable(unsigned char* data, uint32_t offset, char* filename)
 {
+   image_t* image = add_image(intern(filename));
+   image->data = data;
+   image->offset = offset;
+   if (loader_threads > 0 && !load_dylibs_lazily)
+   {
+      scan_image_headers(image);
+      prepare_dependencies(image);
+   }
+   parse_image(image, data, offset);
+}
+
+void load_image(image_t* image)
+{
+   printf("Loading %s on demand\n", image->name->name);
+   parse_image(image, image->data, image->offset);
+}
+
+void parse_image(image_t* image, unsigned char* data, uint32_t offset)
+{
+   char* filename = (char*)image->name->name;
+   struct timespec load_start;
+   struct timespec init_start;
    struct nlist* symbol_table = NULL;
    char* string_table = NULL;
    uint32_t* indirect_table = NULL;
    uint32_t indirect_count = 0;
 
-   segment_list_t* segment_list = NULL;
-   section_list_t* section_list = NULL;   
+   layout_t layout;
    struct load_command* command;
    struct mach_header* header;
    header = (struct mach_header*)data;
-   uint64_t text_segment = 0;
+   uint8_t has_dyld_info = 0;
       
    assert(header->magic == MH_MAGIC);
+   clock_gettime(CLOCK_MONOTONIC, &load_start);
+   if (image->state != IMAGE_OPENED)
+      scan_image_headers(image);
+   // Mark it as loaded straight away, so that binds into it from its own dependencies do not try to load it again
+   image->state = IMAGE_LOADED;
+   images_loaded++;
+   // Everything in the shared cache moves together, by however much the cache itself was slid
+   image->slide = in_cache(data)?cache_slide:choose_slide(image);
+   image->base_address += image->slide;
+   // Images load their dependencies part way through, so each takes its scratch space off the top of the arena and gives it back at the end
+   if (loader_arena == NULL)
+      loader_arena = alloc_arena(LOADER_ARENA_CHUNK);
+   arena_mark_t arena_start = arena_mark(loader_arena);
+   // Every segment has a load command of its own, and every section takes up space in one, which bounds how many there can be
+   layout.segments = arena_alloc(loader_arena, sizeof(segment_t) * header->ncmds);
+   layout.segment_count = 0;
+   layout.sections = arena_alloc(loader_arena, sizeof(section_t) * (header->sizeofcmds / sizeof(struct section)));
+   layout.section_count = 0;
    command = (struct load_command*)(data + sizeof(struct mach_header));
    uint32_t initial_pc = 0;
-   int segment_number = 0;
-   int section_number = 1;
    
    for (int i = 0; i < header->ncmds; i++)
    {
@@ -393,19 +955,19 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
          {            
             struct segment_command* c = (struct segment_command*)command;
             printf("Got segment: %s (with %d sections) mapped to %08x (file offset is %08x)\n", c->segname, c->nsects, c->vmaddr, c->fileoff);
-            if (strcmp(c->segname, "__TEXT") == 0)
-               text_segment = c->vmaddr;
             for (int j = 0; j < c->nsects; j++)
             {
                unsigned char* chunk = NULL;
                struct section* s = (struct section*)(((char*)command) + sizeof(struct segment_command) + j*sizeof(struct section));
-               printf("   Got section #%d (%s) in segment %s (mapped to %08x), file location %08x\n", section_number, s->sectname, c->segname, s->addr, s->offset);
+               uint32_t address = s->addr + image->slide;
+               printf("   Got section #%d (%s) in segment %s (mapped to %08x), file location %08x\n", layout.section_count + 1, s->sectname, c->segname, address, s->offset);
                if ((strcmp(c->segname, "__TEXT") == 0) && (strcmp(s->sectname, "__text") == 0))
                {
-                  initial_pc = s->addr;                  
+                  initial_pc = address;                  
                }
-               chunk = calloc(s->size, 1);
-               if (!((s->flags & 0xff) == S_ZEROFILL))
+               if ((s->flags & 0xff) == S_ZEROFILL)
+                  chunk = calloc(s->size, 1);
+               else
                {
                   uint64_t file_base = 0;
                   // I do not understand this; some of the sections have fileoff relative to the start of the image, but some are absolute from the start of the file
@@ -415,27 +977,32 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
                   else
                      file_base = s->offset - offset;
                   // Print the message with the position relative to the start of the file, for the sake of sanity
-                  printf("Mapping data from absolute file location %016llx to memory address %08x\n", file_base + offset, s->addr);
-                  memcpy(chunk, &data[file_base], s->size);
+                  printf("Mapping data from absolute file location %016llx to memory address %08x\n", file_base + offset, address);
+                  // The file is mapped copy-on-write, so the guest can have the section in place
+                  chunk = &data[file_base];
                }
-               map_memory(chunk, s->addr, s->size);
-               section_list_t* section = malloc(sizeof(section_list_t));
-               section->next = section_list;
-               section->base_address = s->addr;
-               section->section_number = section_number;
+               if (in_cache(data) && cache_slide != 0)
+                  map_memory_with_fixup(chunk, address, s->size, slide_cache_page);
+               else
+                  map_memory(chunk, address, s->size);
+               // A zerofill section is ours, rather than part of the file
+               page_tables->owned = ((s->flags & 0xff) == S_ZEROFILL);
+               section_t* section = &layout.sections[layout.section_count++];
+               section->base_address = address;
                section->flags = s->flags;
                section->size = s->size;
-               section_number++;
-               section_list = section;
+               section->reserved1 = s->reserved1;
+               section->data = chunk;
                if (s->reserved1 != 0)
                   printf("Section %s has reserved1: %08x and base %08x\n", s->sectname, s->reserved1, s->addr);               
             }
-            segment_list_t* node = malloc(sizeof(segment_list_t));
-            node->next = segment_list;
-            node->segment_number = segment_number;
-            node->base_address = c->vmaddr;
-            segment_number++;
-            segment_list = node;
+            layout.segments[layout.segment_count++].base_address = c->vmaddr + image->slide;
+            coverage_note_segment(image->name, c->vmaddr + image->slide, c->vmsize);
+#ifdef WITH_FUNCTION_LABELS
+            // Function names for cache images are only read once something actually runs in them
+            if (in_cache(data) && strcmp(c->segname, "__TEXT") == 0)
+               add_pending_functions(c->vmaddr + image->slide, c->vmaddr + c->vmsize + image->slide, symbolize_cache_image, image);
+#endif
             break;
          }
          case LC_SYMTAB:
@@ -445,12 +1012,13 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
             symbol_table = (struct nlist*)(&data[c->symoff - offset]);
             string_table = (char*)&data[c->stroff - offset];
 #ifdef WITH_FUNCTION_LABELS
-            for (int j = 0; j < c->nsyms; j++)
+            // Cache images are dealt with lazily (see LC_SEGMENT above)
+            for (int j = 0; j < c->nsyms && !in_cache(data); j++)
             {
                struct nlist* index_ptr = &symbol_table[j];
                if ((index_ptr->n_type & N_TYPE) == N_SECT)
                {
-                  found_function(filename, &data[c->stroff + index_ptr->n_un.n_strx - offset], index_ptr->n_value);
+                  found_function(intern(filename), intern((char*)&data[c->stroff + index_ptr->n_un.n_strx - offset]), (index_ptr->n_value + image->slide) | ((index_ptr->n_desc & N_ARM_THUMB_DEF)?1:0));
                   printf("%s provides symbol %s at address %08x with type %02x and attributes %04x section is #%d\n", filename, &data[c->stroff + index_ptr->n_un.n_strx - offset], index_ptr->n_value, index_ptr->n_type, index_ptr->n_desc, index_ptr->n_sect);
                }
             }
@@ -468,14 +1036,16 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
          case LC_DYLD_INFO_ONLY:
          {
             struct dyld_info_command* c = (struct dyld_info_command*)command;
-            unsigned char tmp_buffer[4096];
+            has_dyld_info = 1;
             printf("Exports from %s start at 0x%x and are %d long\n", filename, c->export_off, c->export_size);
-            tmp_buffer[0] = 0;
-            parse_export_tree(&data[c->export_off - offset], &data[c->export_off - offset], &data[c->export_off + c->export_size - offset], (unsigned char*)&tmp_buffer, (unsigned char*)&tmp_buffer, text_segment);
+            // Slide pointers before anything is bound, as dyld does, so that a bind always has the last word on a slot. Cache images
+            // are slid a page at a time by the cache's own slide info as they are touched, so rebasing them as well would slide twice
+            if (image->slide != 0 && !in_cache(data))
+               rebase_image(&layout, &data[c->rebase_off - offset], &data[c->rebase_off + c->rebase_size - offset], image->slide);
             printf("Binding symbols from %s (%d bytes of binding opcodes)\n", filename, c->bind_size);
-            bind_symbols(filename, segment_list, "external", &data[c->bind_off - offset], &data[c->bind_off + c->bind_size - offset]);
+            bind_symbols(image, &layout, "external", &data[c->bind_off - offset], &data[c->bind_off + c->bind_size - offset]);
             printf("Binding lazy symbols from  %s (%d bytes of binding opcodes)\n", filename, c->lazy_bind_size);
-            bind_symbols(filename, segment_list, "lazy", &data[c->lazy_bind_off - offset], &data[c->lazy_bind_off + c->lazy_bind_size - offset]);            
+            bind_symbols(image, &layout, "lazy", &data[c->lazy_bind_off - offset], &data[c->lazy_bind_off + c->lazy_bind_size - offset]);            
             
             break;
          }
@@ -509,7 +1079,7 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
             state.r[12] = base[14];
             //state.r[13] = base[15];   // Do not destroy the stack!
             state.r[14] = base[16];
-            state.r[15] = base[17];
+            state.r[15] = base[17] + image->slide;
             //state.cspr = base[??];
             break;
          }
@@ -518,23 +1088,28 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
             break;
          case LC_REEXPORT_DYLIB: // Fallthrough
             printf("Reexporting....\n");
+         case LC_LOAD_WEAK_DYLIB: // Fallthrough
          case LC_LOAD_DYLIB:
          {
             struct dylib_command* c = (struct dylib_command*)command;
-            uint8_t dylib_already_loaded = 0;
-            for (loaded_dylib_t* x = loaded_dylibs; x; x = x->next)
+            symbol_t name = intern(((char*)command) + c->dylib.name.offset);
+            image_t* dylib = find_image_by_install_name(name);
+            // Either way it is registered now, so that binds into it have something to wait on until it is loaded
+            if (dylib == NULL)
+               dylib = add_image(name);
+            // When loading lazily, it is only loaded once a bind actually resolves into it
+            if (load_dylibs_lazily)
+               break;
+            if (dylib->state != IMAGE_LOADED)
             {
-               if (strcmp(x->dylib_name, ((char*)command) + c->dylib.name.offset) == 0)
+               printf("Load dylib %s (compatibility version %d.%d.%d, current version %d.%d.%d)\n", ((unsigned char*)command) + c->dylib.name.offset, (c->dylib.compatibility_version >> 16) & 0xffff, (c->dylib.compatibility_version >> 8) & 0xff, (c->dylib.compatibility_version >> 0) & 0xff, (c->dylib.current_version >> 16) & 0xffff, (c->dylib.current_version >> 8) & 0xff, (c->dylib.current_version >> 0) & 0xff);
+               // Weak dylibs are allowed to be missing. Anything that was waiting for one has to make do with a flat lookup
+               if (!load_dylib(name))
                {
-                  dylib_already_loaded = 1;
-                  break;
+                  assert(command->cmd == LC_LOAD_WEAK_DYLIB);
+                  bind_pending_symbols(dylib);
                }
             }
-            if (!dylib_already_loaded)
-            {
-               printf("Load dylib %s (compatibility version %d.%d.%d, current version %d.%d.%d)\n", ((unsigned char*)command) + c->dylib.name.offset, (c->dylib.compatibility_version >> 16) & 0xffff, (c->dylib.compatibility_version >> 8) & 0xff, (c->dylib.compatibility_version >> 0) & 0xff, (c->dylib.current_version >> 16) & 0xffff, (c->dylib.current_version >> 8) & 0xff, (c->dylib.current_version >> 0) & 0xff);
-               assert(load_dylib(filename, ((char*)command) + c->dylib.name.offset));
-            }
             break;
          }
          case LC_LOAD_DYLINKER:
@@ -558,7 +1133,10 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
          }
          case LC_FUNCTION_STARTS:
          {
-            printf("Function start table. Ignored\n");
+            // Cache images have theirs read along with their names, if anything ever runs in them (see symbolize_cache_image())
+            struct linkedit_data_command* c = (struct linkedit_data_command*)command;
+            if (!in_cache(data))
+               report_function_starts(image, &data[c->dataoff - offset], c->datasize);
             break;
          }
          case LC_VERSION_MIN_IPHONEOS:
@@ -573,28 +1151,55 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
       command = (struct load_command*)((char*)command + command->cmdsize);
    }
 
+   // The function entry points are known now, so the pre-decoder can make a start on them while we bind and initialize
+   if (predecode_enabled())
+   {
+      for (section_t* section = layout.sections; section < layout.sections + layout.section_count; section++)
+      {
+         if (section->flags & (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS))
+         {
+            predecode_section = section;
+            forall_function_entries(section->base_address, section->base_address + section->size, predecode_entry);
+         }
+      }
+   }
+
    // Ok, all loaded. Only now can we process the indirect symbols!
    printf("Resolving indirect symbols for %s\n", filename);
-   for (section_list_t* section = section_list; section; section = section->next)
+   for (section_t* section = layout.sections; section < layout.sections + layout.section_count; section++)
    {
-      if (section->flags == S_LAZY_SYMBOL_POINTERS)
+      // The lazy binding opcodes already cover these slots if there were any
+      if (section->flags == S_LAZY_SYMBOL_POINTERS && !has_dyld_info)
       {
          assert(indirect_table != NULL);             // Must have a dsymtab or we will not have a good time
          assert(symbol_table != NULL);               // Must have a symtab or we will not have a good time either
          uint32_t indirect_symbols_this_section = section->size / sizeof(uint32_t);
+         // reserved1 is the index of this section's first entry in the indirect symbol table
+         uint32_t* indirect_symbols = &indirect_table[section->reserved1];
          for (int j = 0; j < indirect_symbols_this_section; j++)
          {            
-            if (indirect_table[j] == INDIRECT_SYMBOL_ABS)
+            if (indirect_symbols[j] == INDIRECT_SYMBOL_ABS)
                continue;
-            if (indirect_table[j] == (INDIRECT_SYMBOL_ABS | INDIRECT_SYMBOL_LOCAL))
+            if (indirect_symbols[j] == (INDIRECT_SYMBOL_ABS | INDIRECT_SYMBOL_LOCAL))
                continue;
-            if (indirect_table[j] == INDIRECT_SYMBOL_LOCAL)
+            if (indirect_symbols[j] == INDIRECT_SYMBOL_LOCAL)
                continue;         
-            struct nlist* ptr = &symbol_table[indirect_table[j]];
+            struct nlist* ptr = &symbol_table[indirect_symbols[j]];
             printf("%s needs symbol %s at %08lx\n", filename, &string_table[ptr->n_un.n_strx], section->base_address + (sizeof(uint32_t) * j));
-            need_symbol(&string_table[ptr->n_un.n_strx], section->base_address + (sizeof(uint32_t) * j));
+            // Undefined symbols carry the ordinal of the library they come from in the high byte of n_desc, unless the image was
+            // linked for a flat namespace, in which case there is nothing there
+            uint32_t ordinal = (header->flags & MH_TWOLEVEL)?(((uint16_t)ptr->n_desc >> 8) & 0xff):DYNAMIC_LOOKUP_ORDINAL;
+            need_lazy_symbol(intern(&string_table[ptr->n_un.n_strx]), section->base_address + (sizeof(uint32_t) * j), image, ordinal);
          }
       }
+   }
+
+   // Everything this image (and its dependencies) asked for is now queued, so bind it all in one go before any of its code runs
+   bind_pending_symbols(image);
+   clock_gettime(CLOCK_MONOTONIC, &init_start);
+
+   for (section_t* section = layout.sections; section < layout.sections + layout.section_count; section++)
+   {
       if (section->flags == S_MOD_INIT_FUNC_POINTERS)
       {
          // This section contains just pointers to bits of code we have to execute to initialize it
@@ -603,35 +1208,79 @@ void parse_executable(unsigned char* data, uint32_t offset, char* filename)
          {
             printf("Running initializer at %08x in binary %s\n", section->base_address + 4*j, filename);
             uint32_t address = read_mem(4, section->base_address + 4*j);
-            _execute_function(1, read_mem(4, section->base_address + 4*j));
+            execute_function(address);
+            // Whatever needed this image cannot go on without it, so neither can anything else here
+            if (machine_stopped(NULL))
+               break;
          }
       }
    }
-   free_segment_list(segment_list);
-   free_section_list(section_list);  
+   arena_reset(loader_arena, arena_start);
+   printf("Image %s took %.3fms to load and %.3fms to initialize\n", filename, milliseconds_since(&load_start) - milliseconds_since(&init_start), milliseconds_since(&init_start));
 }
 
 
-void load_executable(char* filename)
+__thread mapped_file_t* mapped_files = NULL;
+
+// Maps a whole file privately: pages are only read in when touched, and writes to them (by the guest) are never seen by the file.
+// NULL if it cannot be opened or mapped
+unsigned char* map_whole_file(char* filename, size_t* length)
+{
+   struct stat info;
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1)
+   {
+      printf("Could not open %s\n", filename);
+      return NULL;
+   }
+   if (fstat(fd, &info) != 0 || info.st_size == 0)
+   {
+      printf("Could not map %s\n", filename);
+      close(fd);
+      return NULL;
+   }
+   unsigned char* data = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED)
+   {
+      printf("Could not map %s\n", filename);
+      return NULL;
+   }
+   *length = info.st_size;
+   return data;
+}
+
+void note_mapped_file(char* filename, unsigned char* data, size_t length)
+{
+   mapped_file_t* file = malloc(sizeof(mapped_file_t));
+   file->path = strdup(filename);
+   file->data = data;
+   file->length = length;
+   file->next = mapped_files;
+   mapped_files = file;
+}
+
+unsigned char* map_file(char* filename, size_t* length)
 {
-   unsigned char* data;
-   FILE* file = NULL;
    size_t file_length;
+   unsigned char* data = map_whole_file(filename, &file_length);
+   if (data == NULL)
+      return NULL;
+   note_mapped_file(filename, data, file_length);
+   if (length != NULL)
+      *length = file_length;
+   return data;
+}
+
+// Returns the mach header of the ARM slice of the file, or NULL if it has none. Other slices are never touched, so they are never
+// paged in
+unsigned char* arm_slice(unsigned char* data)
+{
    struct mach_header* header;
    uint32_t base = 0;
 
-   if (try_cache(filename))
-     return; // try_cache will load it for us
-   
-   file = fopen(filename, "rb");
-   assert(file);
-   fseek(file, 0, SEEK_END);
-   file_length = ftell(file);
-   fseek(file, 0, SEEK_SET);
-   data = malloc(file_length);
-   fread(data, file_length, 1, file);
-   fclose(file);
-
+   if (data == NULL)
+      return NULL;
    header = (struct mach_header*)data;
    if (header->magic == FAT_CIGAM)
    {
@@ -651,10 +1300,36 @@ void load_executable(char* filename)
             break;
          }
       }
-      assert(arch_found);
+      if (!arch_found)
+      {
+         printf("No ARM slice in universal binary\n");
+         return NULL;
+      }
    }
-   parse_executable(&data[base], 0, filename);
-   free(data);
+   if (header->magic != MH_MAGIC)
+   {
+      printf("Not a 32-bit Mach-O file\n");
+      return NULL;
+   }
+   // This is not unmapped until the machine goes: the image's sections and export trie are in there
+   return &data[base];
+}
+
+unsigned char* read_executable(char* filename)
+{
+   return arm_slice(map_file(filename, NULL));
+}
+
+// Returns 0 if there is nothing there to load. Otherwise, the machine is stopped if anything failed along the way
+int load_executable(char* filename)
+{
+   if (try_cache(filename))
+     return 1; // try_cache will load it for us
+   unsigned char* data = read_executable(filename);
+   if (data == NULL)
+      return 0;
+   parse_executable(data, 0, filename);
+   return 1;
 }
 
 
@@ -662,40 +1337,75 @@ void load_executable(char* filename)
 breakpoint_t* find_breakpoint(uint32_t pc)
 {
    breakpoint_t* breakpoint;
-   if (map_get(breakpoints, &pc, (void**)&breakpoint))
+   if (int_map_get(breakpoints, pc, (void**)&breakpoint))
    {
-      printf("  *** %s\n", breakpoint->symbol_name);
+      printf("  *** %s\n", breakpoint->symbol->name);
       return breakpoint;
    }
    assert(0 && "Illegal breakpoint");
 }
 
-uint32_t hash_uint32(void* x)
-{
-   return *((uint32_t*)x);
-}
-
-int comparator_uint32(void* x, void* y)
-{
-   return *((uint32_t*)x) - *((uint32_t*)y);
-}
-
 void free_breakpoint(void* ptr)
 {
-   breakpoint_t* breakpoint = (breakpoint_t*)ptr;
-   free(breakpoint->symbol_name);
+   // The name is interned, so only the breakpoint itself belongs to us
+   free(ptr);
 }
 
 void prepare_loader()
 {
-   breakpoints = alloc_map(free_breakpoint, hash_uint32, comparator_uint32);
-   unsigned char* hypervisor_break = malloc(4);
+   breakpoints = alloc_int_map(free_breakpoint);
    printf("Mapping memory to 0xfffffff0\n");
-   map_memory(hypervisor_break, 0xfffffff0, 4);
+   map_new_memory(0xfffffff0, 4);
    write_mem(4, 0xfffffff0, BREAK32);
    load_dyld_cache("dyld_shared_cache_armv7");
 
-   unsigned char* tls = calloc(2048, 1);
-   map_memory(tls, 0x80000000, 2048);
+   map_new_memory(0x80000000, 2048);
    
 }
+
+// Undoes prepare_loader() and everything loaded since. The memory the guest saw must already have been unmapped
+void free_loader()
+{
+   free_dyld_cache();
+   while (mapped_files != NULL)
+   {
+      mapped_file_t* file = mapped_files;
+      mapped_files = file->next;
+      munmap(file->data, file->length);
+      free(file->path);
+      free(file);
+   }
+   if (breakpoints != NULL)
+      free_int_map(breakpoints);
+   if (dylib_paths != NULL)
+      free_map(dylib_paths);
+   if (prepared_images != NULL)
+      free_map(prepared_images);
+   if (loader_arena != NULL)
+      free_arena(loader_arena);
+   breakpoints = NULL;
+   dylib_paths = NULL;
+   prepared_images = NULL;
+   images_loaded = 0;
+   images_loaded_when_complete = 0;
+   loader_arena = NULL;
+   predecode_section = NULL;
+   next_break = 0xa0000000;
+   next_relocated_image = RELOCATED_IMAGE_BASE;
+   current_page_offset = 0;
+}
+
+void loader_context(context_t* c)
+{
+   CONTEXT_VAR(c, loader_arena);
+   CONTEXT_VAR(c, next_break);
+   CONTEXT_VAR(c, breakpoints);
+   CONTEXT_VAR(c, current_page_offset);
+   CONTEXT_VAR(c, dylib_paths);
+   CONTEXT_VAR(c, images_loaded);
+   CONTEXT_VAR(c, images_loaded_when_complete);
+   CONTEXT_VAR(c, next_relocated_image);
+   CONTEXT_VAR(c, prepared_images);
+   CONTEXT_VAR(c, predecode_section);
+   CONTEXT_VAR(c, mapped_files);
+}
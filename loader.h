@@ -3,19 +3,55 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <mach-o/loader.h>
 #include <mach-o/fat.h>
 #include <mach-o/nlist.h>
+#include "intern.h"
+#include "image.h"
 
 typedef struct
 {
-   char* symbol_name;
+   symbol_t symbol;
    uint32_t (*handler)();
+   uint32_t lazy_pointer;    // Non-zero if this is a lazy binding trampoline; the slot to patch once the symbol is resolved
+   image_t* image;           // Where to look for the symbol when binding lazily
+   uint32_t ordinal;
 } breakpoint_t;
 
+// Every file we have mapped, so that a snapshot can describe guest memory by where it came from rather than by what is in it
+struct mapped_file_t
+{
+   char* path;
+   unsigned char* data;
+   size_t length;
+   struct mapped_file_t* next;
+};
+
+typedef struct mapped_file_t mapped_file_t;
+
+extern __thread mapped_file_t* mapped_files;
+extern __thread int_map_t* breakpoints;
+extern __thread uint32_t next_break;
+extern __thread uint32_t next_relocated_image;
+extern uint8_t bind_lazily;
+extern uint8_t load_dylibs_lazily;
+extern uint32_t loader_threads;
+
 breakpoint_t* find_breakpoint(uint32_t pc);
-void load_executable(char* filename);
+int bind_lazy_pointer(breakpoint_t* breakpoint, uint32_t* target);
+unsigned char* map_file(char* filename, size_t* length);
+unsigned char* map_whole_file(char* filename, size_t* length);
+int load_executable(char* filename);
 void parse_executable(unsigned char* data, uint32_t offset, char* filename);
+int open_image(image_t* image);
+void scan_image_headers(image_t* image);
+void report_function_starts(image_t* image, unsigned char* p, uint32_t size);
+void restore_lazy_breakpoint(uint32_t address, symbol_t symbol, uint32_t lazy_pointer, image_t* image, uint32_t ordinal);
+void load_image(image_t* image);
+void load_remaining_dylibs();
+void add_search_root(char* root);
+double milliseconds_since(struct timespec* start);
 
 struct stub_t
 {
@@ -28,5 +64,6 @@ typedef struct stub_t stub_t;
 
 void register_stub(char* stub_name, uint32_t(*_stub)());
 void prepare_loader();
+void free_loader();
 
 #define VPAGE_SIZE 4096
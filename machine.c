@@ -4,16 +4,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "arm.h"
 #include "loader.h"
 #include "stubs.h"
+#include "dyld_cache.h"
 #include "machine.h"
-#include "hardware.h"
 #include "coprocessor.h"
 #include "symtab.h"
 #include "syscall.h"
 #include "function_map.h"
+#include "map.h"
+#include "coverage.h"
+#include "context.h"
 
 
 #define HaveLPAE() 0
@@ -86,17 +92,28 @@ char* shift_name[] = {"lsl", "lsr", "asr", "rrx", "ror"};
 
 char* reg_name[] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc"};
 
-struct page_table_t
+__thread page_table_t* page_tables = NULL;
+__thread int_map_t* page_index = NULL;   // Guest page number -> the newest region known to cover an address in that page
+
+// Pages that several regions share (sections are rarely page aligned) are split into the bytes each region answers for the first time
+// one is walked, so later accesses to the parts the page index does not cover need not walk again. A page in more pieces than this
+// is just walked every time
+#define MAX_PAGE_SPLIT 16
+
+typedef struct
 {
-   unsigned char* data;
-   uint32_t address;
-   uint32_t length;
-   struct page_table_t* next;
-};
+   uint16_t start;               // Offsets within the page
+   uint16_t end;
+   page_table_t* table;
+} page_piece_t;
 
-typedef struct page_table_t page_table_t;
+typedef struct
+{
+   uint32_t count;
+   page_piece_t pieces[MAX_PAGE_SPLIT];
+} page_split_t;
 
-page_table_t* page_tables = NULL;
+__thread int_map_t* page_splits = NULL;  // Guest page number -> page_split_t, or NULL once a newer region has been mapped over it
 
 #define PC r[15]
 #define SP r[13]
@@ -128,22 +145,146 @@ void not_decoded(char* t, int line) {printf("Instruction %s is not decoded on li
 #define CHECK_CONDITION  {if (!condition_passed(instruction.condition)) continue;}
 
 
-state_t state;
+__thread state_t state;
 
-unsigned char stack[1024 * 1024];
 
+void fixup_page(page_table_t* t, uint32_t addr)
+{
+   uint32_t page = addr / VPAGE_SIZE - t->address / VPAGE_SIZE;
+   if (t->unfixed[page / 8] & (1 << (page % 8)))
+   {
+      t->unfixed[page / 8] &= ~(1 << (page % 8));
+      t->fixup(addr & ~(VPAGE_SIZE - 1));
+   }
+}
 
-unsigned char* map_addr(uint32_t addr)
+#define FIXUP_PAGE(t, addr) {if ((t)->unfixed != NULL) fixup_page(t, addr);}
+
+// Works out which region answers for each byte of a page, newest first, as map_addr() would. NULL if it comes to too many pieces
+page_split_t* split_page(uint32_t page)
 {
+   uint64_t page_start = (uint64_t)page * VPAGE_SIZE;
+   page_split_t* split = malloc(sizeof(page_split_t));
+   split->count = 0;
    for (page_table_t* t = page_tables; t; t = t->next)
+   {
+      // Regions answer for the byte just past their end too (see map_addr())
+      int64_t low = (int64_t)t->address - (int64_t)page_start;
+      int64_t high = low + (int64_t)t->length + 1;
+      low = (low < 0)?0:low;
+      high = (high > VPAGE_SIZE)?VPAGE_SIZE:high;
+      // Add whatever part of [low, high) no newer region has already claimed
+      uint32_t cursor = low;
+      while ((int64_t)cursor < high)
+      {
+         uint32_t gap_end = high;
+         uint8_t claimed = 0;
+         for (uint32_t i = 0; i < split->count; i++)
+         {
+            if (split->pieces[i].start <= cursor && cursor < split->pieces[i].end)
+            {
+               cursor = split->pieces[i].end;
+               claimed = 1;
+               break;
+            }
+            if (split->pieces[i].start > cursor && split->pieces[i].start < gap_end)
+               gap_end = split->pieces[i].start;
+         }
+         if (claimed)
+            continue;
+         if (split->count == MAX_PAGE_SPLIT)
+         {
+            free(split);
+            return NULL;
+         }
+         split->pieces[split->count].start = cursor;
+         split->pieces[split->count].end = gap_end;
+         split->pieces[split->count].table = t;
+         split->count++;
+         cursor = gap_end;
+      }
+   }
+   return split;
+}
+
+unsigned char* map_addr(uint32_t addr)
+{
+   page_table_t* t;
+   uint32_t page = addr / VPAGE_SIZE;
+   if (int_map_get(page_index, page, (void**)&t) && addr >= t->address && addr <= (t->address + t->length))
+   {
+      FIXUP_PAGE(t, addr);
+      return &t->data[addr - t->address];
+   }
+   // The newest region in the page does not cover this part of it, so some older one (sharing the page) must
+   page_split_t* split;
+   if (page_splits != NULL && int_map_get(page_splits, page, (void**)&split) && split != NULL)
+   {
+      uint32_t offset = addr % VPAGE_SIZE;
+      for (uint32_t i = 0; i < split->count; i++)
+      {
+         if (split->pieces[i].start <= offset && offset < split->pieces[i].end)
+         {
+            t = split->pieces[i].table;
+            FIXUP_PAGE(t, addr);
+            return &t->data[addr - t->address];
+         }
+      }
+   }
+   // Not in the index. Walk the regions (newest first) and remember the answer. If some newer region also shares this page, the
+   // index could end up shadowing it, so the page is split up instead
+   uint8_t shared = 0;
+   for (t = page_tables; t; t = t->next)
    {
       if (addr >= t->address && addr <= (t->address + t->length))
+      {
+         if (!shared)
+            int_map_put(page_index, page, t);
+         else if ((split = split_page(page)) != NULL)
+         {
+            if (page_splits == NULL)
+               page_splits = alloc_int_map(free);
+            int_map_put(page_splits, page, split);
+         }
+         FIXUP_PAGE(t, addr);
          return &t->data[addr - t->address];
+      }
+      if (t->address / VPAGE_SIZE <= page && (t->address + t->length) / VPAGE_SIZE >= page)
+         shared = 1;
    }
    printf("Attempted to read from unmapped address %08x\n", addr);
    assert(0 && "memory access violation");
 }
 
+// Like map_addr, but also says how many bytes from addr (up to the end of its page) can be reached through the returned pointer.
+// Only the page index is trusted, since whatever it holds for a page is the newest region touching that page: nothing can shadow
+// part of the window. Returns NULL if the index does not know the answer, in which case the caller should use read_mem/write_mem
+unsigned char* map_range(uint32_t addr, uint32_t* length)
+{
+   page_table_t* t;
+   uint32_t page = addr / VPAGE_SIZE;
+   if (page_index == NULL || !int_map_get(page_index, page, (void**)&t) || addr < t->address || addr >= t->address + t->length)
+      return NULL;
+   uint64_t end = (uint64_t)(page + 1) * VPAGE_SIZE;
+   if ((uint64_t)t->address + t->length < end)
+      end = (uint64_t)t->address + t->length;
+   *length = end - addr;
+   FIXUP_PAGE(t, addr);
+   return &t->data[addr - t->address];
+}
+
+int range_is_mapped(uint32_t address, uint32_t length)
+{
+   for (page_table_t* t = page_tables; t; t = t->next)
+   {
+      if ((uint64_t)address < (uint64_t)t->address + t->length && (uint64_t)t->address < (uint64_t)address + length)
+         return 1;
+   }
+   return 0;
+}
+
+extern __thread uint32_t* page_generations;
+
 void map_memory(unsigned char* data, uint32_t address, uint32_t length)
 {
 //printf("Adding page for %08x to %08x\n", address, address+length);
@@ -153,16 +294,77 @@ void map_memory(unsigned char* data, uint32_t address, uint32_t length)
    new_table->data = data;
    new_table->address = address;
    new_table->length = length;
+   new_table->fixup = NULL;
+   new_table->unfixed = NULL;
+   new_table->owned = 0;
+   new_table->mapped = 0;
+   // The new region shadows anything older, so it must take over every page it touches in the index
+   if (page_index == NULL)
+      page_index = alloc_int_map(NULL);
+   for (uint32_t page = address / VPAGE_SIZE; page <= (address + length) / VPAGE_SIZE; page++)
+   {
+      int_map_put(page_index, page, new_table);
+      // Nothing decoded from what used to be here still applies
+      if (page_generations != NULL)
+         __atomic_add_fetch(&page_generations[page], 1, __ATOMIC_RELEASE);
+      page_split_t* split;
+      if (page_splits != NULL && int_map_get(page_splits, page, (void**)&split) && split != NULL)
+      {
+         free(split);
+         int_map_put(page_splits, page, NULL);
+      }
+   }
+}
+
+// For memory whose contents need adjusting before use (such as pointers in a slid shared cache). Rather than doing it all up front,
+// fixup is called with the address of each page just before that page is first accessed
+void map_memory_with_fixup(unsigned char* data, uint32_t address, uint32_t length, void (*fixup)(uint32_t page))
+{
+   map_memory(data, address, length);
+   uint32_t pages = (address + length) / VPAGE_SIZE - address / VPAGE_SIZE + 1;
+   page_tables->fixup = fixup;
+   page_tables->unfixed = malloc((pages + 7) / 8);
+   memset(page_tables->unfixed, 0xff, (pages + 7) / 8);
+}
+
+// Memory that belongs to the machine itself, rather than to a file or to whoever asked for it. It starts out zeroed
+unsigned char* map_new_memory(uint32_t address, uint32_t length)
+{
+   unsigned char* data = calloc(length, 1);
+   map_memory(data, address, length);
+   page_tables->owned = 1;
+   return data;
+}
+
+// Forgets every region (newest first, as they were mapped). Unless the machine owns what they point at, it still belongs to whoever mapped it
+void unmap_all_memory()
+{
+   while (page_tables)
+   {
+      page_table_t* t = page_tables;
+      page_tables = t->next;
+      if (t->owned)
+         free(t->data);
+      else if (t->mapped)
+         munmap(t->data, (t->length == 0)?1:t->length);
+      free(t->unfixed);
+      free(t);
+   }
+   if (page_index != NULL)
+      free_int_map(page_index);
+   if (page_splits != NULL)
+      free_int_map(page_splits);
+   page_index = NULL;
+   page_splits = NULL;
 }
 
-uint32_t next_page = 0x80000000;
+__thread uint32_t next_page = 0x80000000;
 
 uint32_t alloc_page()
 {
    uint32_t address = next_page;
    next_page += VPAGE_SIZE;
-   unsigned char* page = malloc(VPAGE_SIZE);
-   map_memory(page, address, VPAGE_SIZE);
+   map_new_memory(address, VPAGE_SIZE);
    return address;
 }
 
@@ -428,6 +630,110 @@ typedef struct
 } instruction_t;
 
 
+// Bumped by every write to a page (once the decode cache is on), which invalidates anything decoded from that page before then
+__thread uint32_t* page_generations = NULL;
+
+void page_written(uint32_t addr, uint8_t count)
+{
+   __atomic_add_fetch(&page_generations[addr / VPAGE_SIZE], 1, __ATOMIC_RELEASE);
+   if ((addr + count - 1) / VPAGE_SIZE != addr / VPAGE_SIZE)
+      __atomic_add_fetch(&page_generations[(addr + count - 1) / VPAGE_SIZE], 1, __ATOMIC_RELEASE);
+}
+
+// With call isolation on, the first write to each page during an execute_function() saves what was in the page, and it is all put back
+// when the function returns. Each call then sees the machine as it was before the first one, at a cost of a page copy per page written
+__thread uint8_t isolate_calls = 0;
+__thread uint8_t tracking_writes = 0;
+__thread uint8_t* dirty_bitmap = NULL;          // One bit per guest page, set once it has been saved
+__thread uint32_t* dirty_pages = NULL;
+__thread unsigned char* dirty_originals = NULL;  // VPAGE_SIZE bytes for each of dirty_pages
+__thread uint32_t dirty_count = 0;
+__thread uint32_t dirty_capacity = 0;
+
+// Copies a guest page to or from buffer. Pages can be shared by several regions (sections are rarely page aligned), and parts of one
+// may not be mapped at all, so each byte is found in the newest region covering it. Unmapped bytes are left alone
+void copy_guest_page(uint32_t page, unsigned char* buffer, uint8_t to_guest)
+{
+   uint64_t start = (uint64_t)page * VPAGE_SIZE;
+   uint64_t end = start + VPAGE_SIZE;
+   page_table_t* t;
+   if (int_map_get(page_index, page, (void**)&t) && t->address <= start && (uint64_t)t->address + t->length >= end)
+   {
+      // By far the commonest case: the newest region for the page covers all of it
+      FIXUP_PAGE(t, start);
+      if (to_guest)
+         memcpy(&t->data[start - t->address], buffer, VPAGE_SIZE);
+      else
+         memcpy(buffer, &t->data[start - t->address], VPAGE_SIZE);
+      return;
+   }
+   uint8_t covered[VPAGE_SIZE / 8];
+   memset(covered, 0, sizeof(covered));
+   for (t = page_tables; t; t = t->next)
+   {
+      uint64_t low = (t->address > start)?t->address:start;
+      uint64_t high = ((uint64_t)t->address + t->length < end)?(uint64_t)t->address + t->length:end;
+      if (low >= high)
+         continue;
+      FIXUP_PAGE(t, low);
+      for (uint64_t a = low; a < high; a++)
+      {
+         uint32_t i = a - start;
+         if (covered[i / 8] & (1 << (i % 8)))
+            continue;
+         covered[i / 8] |= (1 << (i % 8));
+         if (to_guest)
+            t->data[a - t->address] = buffer[i];
+         else
+            buffer[i] = t->data[a - t->address];
+      }
+   }
+}
+
+void save_dirty_page(uint32_t page)
+{
+   if (dirty_bitmap[page / 8] & (1 << (page % 8)))
+      return;
+   dirty_bitmap[page / 8] |= (1 << (page % 8));
+   if (dirty_count == dirty_capacity)
+   {
+      dirty_capacity = (dirty_capacity == 0)?64:(dirty_capacity * 2);
+      dirty_pages = realloc(dirty_pages, sizeof(uint32_t) * dirty_capacity);
+      dirty_originals = realloc(dirty_originals, (size_t)VPAGE_SIZE * dirty_capacity);
+   }
+   dirty_pages[dirty_count] = page;
+   copy_guest_page(page, &dirty_originals[(size_t)VPAGE_SIZE * dirty_count], 0);
+   dirty_count++;
+}
+
+void set_call_isolation(uint8_t on)
+{
+   isolate_calls = on;
+   if (on && dirty_bitmap == NULL)
+      dirty_bitmap = calloc(0x100000000ull / VPAGE_SIZE / 8, 1);
+}
+
+void start_tracking_writes()
+{
+   tracking_writes = 1;
+}
+
+// Puts back every page written since start_tracking_writes(). Regions mapped in the meantime stay mapped
+uint32_t undo_tracked_writes()
+{
+   uint32_t count = dirty_count;
+   for (uint32_t i = 0; i < dirty_count; i++)
+   {
+      copy_guest_page(dirty_pages[i], &dirty_originals[(size_t)VPAGE_SIZE * i], 1);
+      dirty_bitmap[dirty_pages[i] / 8] &= ~(1 << (dirty_pages[i] % 8));
+      if (page_generations != NULL)
+         page_written(dirty_pages[i] * VPAGE_SIZE, 1);
+   }
+   dirty_count = 0;
+   tracking_writes = 0;
+   return count;
+}
+
 uint64_t read_mem(uint8_t count, uint32_t addr)
 {
    //printf("Reading from %08x\n", addr);
@@ -447,6 +753,12 @@ uint64_t read_mem(uint8_t count, uint32_t addr)
 void write_mem(uint8_t count, uint32_t addr, uint64_t value)
 {
    //printf("Writing 0x%08x to %08x\n", value, addr);
+   if (tracking_writes)
+   {
+      save_dirty_page(addr / VPAGE_SIZE);
+      if ((addr + count - 1) / VPAGE_SIZE != addr / VPAGE_SIZE)
+         save_dirty_page((addr + count - 1) / VPAGE_SIZE);
+   }
    unsigned char* physical = map_addr(addr);
    if (count == 4)
    {
@@ -479,6 +791,24 @@ void write_mem(uint8_t count, uint32_t addr, uint64_t value)
    }
    else
       assert(0 && "Bad write size");
+   if (page_generations != NULL)
+      page_written(addr, count);
+}
+
+// Like map_range(), but for writing straight into the window rather than through write_mem(). The page is saved first if writes are
+// being tracked, and range_written() must be called once the writes are done, so that nothing decoded from the old contents is used
+unsigned char* map_range_for_write(uint32_t addr, uint32_t* length)
+{
+   unsigned char* window = map_range(addr, length);
+   if (window != NULL && tracking_writes)
+      save_dirty_page(addr / VPAGE_SIZE);
+   return window;
+}
+
+void range_written(uint32_t addr)
+{
+   if (page_generations != NULL)
+      page_written(addr, 1);
 }
 
 int32_t SignExtend(uint8_t N, int32_t value, uint8_t length)
@@ -598,7 +928,7 @@ void initialize_state()
 {
    // Map some memory for the stack which will grow DOWN from 0xd0000000
    // Also reserve some space above here for passing args. Really this should be much much smaller!
-   map_memory(stack, 0xd0000000-(512*1024), 1024*1024);
+   map_new_memory(0xd0000000-(512*1024), 1024*1024);
    // Set up the registers
    state.SP = 0xd0000000;
    // Copy in argc and argv...?
@@ -607,17 +937,68 @@ void initialize_state()
    state.t = 0;
 }
 
-int decode_instruction(instruction_t* instruction)
+// The decoder works on a decoder_t rather than on the machine state, so that it can also be run ahead of execution (on another thread,
+// even). Whatever it looks at besides the instruction itself is noted, since a decode can only be reused while that still holds
+typedef struct
+{
+   uint32_t next_instruction;
+   uint32_t pc;                  // What the PC register will read as while this instruction executes
+   uint8_t t;
+   uint8_t c;
+   uint8_t itstate;
+   uint8_t depends_on_state;     // Set if the decode looked at c or itstate
+   uint8_t speculative;          // Decoding ahead of execution: anything odd just fails the decode, rather than stopping the machine
+   unsigned char* code;          // If set, instructions are read from here (code_length bytes of guest memory from code_address)
+   uint32_t code_address;        // rather than through read_mem, which is not safe off the main thread
+   uint32_t code_length;
+} decoder_t;
+
+int fetch(decoder_t* d, uint8_t count, uint32_t* value)
 {
-   //printf("instruction at = %08x, SP = %08x, thumb=%d\n", state.next_instruction, state.SP, state.t);
-   instruction->source_address = state.next_instruction;
-   if (state.t == 0) // ARM mode
+   if (d->code == NULL)
    {
-      uint32_t word = read_mem(4, state.next_instruction);
+      *value = read_mem(count, d->next_instruction);
+      return 1;
+   }
+   if (d->next_instruction < d->code_address || d->next_instruction - d->code_address + count > d->code_length)
+      return 0;
+   unsigned char* p = &d->code[d->next_instruction - d->code_address];
+   if (count == 4)
+      *value = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+   else
+      *value = p[0] | p[1] << 8;
+   return 1;
+}
+
+#define DECODE_ITSTATE (d->depends_on_state = 1, d->itstate)
+#define DECODE_CARRY (d->depends_on_state = 1, d->c)
+#undef IN_IT_BLOCK
+#undef LAST_IN_IT_BLOCK
+#undef ILLEGAL_OPCODE
+#undef NOT_DECODED
+#undef UNPREDICTABLE
+#undef UNDEFINED
+#define IN_IT_BLOCK ((DECODE_ITSTATE & 15) != 0)
+#define LAST_IN_IT_BLOCK ((DECODE_ITSTATE & 15) == 8)
+#define ILLEGAL_OPCODE do {if (d->speculative) return 0; assert(0 && "Illegal opcode");} while(0)
+#define NOT_DECODED(t) do {if (d->speculative) return 0; not_decoded(t, __LINE__);} while(0)
+#define UNPREDICTABLE do {if (d->speculative) return 0; assert(0 && "Unpredictable");} while(0)
+#define UNDEFINED do {if (d->speculative) return 0; printf("Permanently undefined instruction encountered\n"); exit(-1);} while(0)
+// When decoding speculatively, a failed assertion just means that whatever we were looking at was not code after all
+#define DECODE_ASSERT(x) do {if (d->speculative && !(x)) return 0; assert(x);} while(0)
+
+int decode(decoder_t* d, instruction_t* instruction)
+{
+   instruction->source_address = d->next_instruction;
+   if (d->t == 0) // ARM mode
+   {
+      uint32_t word;
+      if (!fetch(d, 4, &word))
+         return 0;
       instruction->this_instruction = word;
       instruction->this_instruction_length = 32;
-      state.PC = state.next_instruction + 8;
-      state.next_instruction += 4;
+      d->pc = d->next_instruction + 8;
+      d->next_instruction += 4;
       instruction->condition = ((word >> 28) & 15);
       uint8_t op1 = (word >> 25) & 7;
       uint8_t op = (word >> 4) & 1;
@@ -751,7 +1132,7 @@ int decode_instruction(instruction_t* instruction)
                else if (((op1 & 0b11001) != 0b10000) && ((op2 & 0b1001) == 1))
                {
                   // Data-processing (register-shifted register)
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if (((op1 & 0b11001) == 0b10000) && ((op2 & 0b1000) == 0))
                {
@@ -812,7 +1193,7 @@ int decode_instruction(instruction_t* instruction)
                   else if (op2 == 5)
                   {
                      // Saturating addition/subtraction
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                   else if (op2 == 6 && op == 3)
                      NOT_DECODED("ERET");
@@ -833,12 +1214,12 @@ int decode_instruction(instruction_t* instruction)
                else if (((op2 & 0b11001) == 0b10000) && ((op2 & 0b1001) == 0b1000))
                {
                   // Halfword multiply and multiply accumulate
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if (((op1 & 0b10000) == 0) && (op2 == 0b1001))
                {
                   // Multiply and multiply accumulate
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if (((op1 & 0b10000) == 0b10000) && (op2 == 0b1001))
                {
@@ -896,17 +1277,17 @@ int decode_instruction(instruction_t* instruction)
                   }
 
                   // Synchronization
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if ((((op1 & 0b10010) != 0b00010) && (op2 == 0b1011 || ((op2 & 0b1101) == 0b1101))) || (((op1 & 0b10010) == 0b00010) && ((op2 & 0b1101) == 0b1101)))
                {
                   // exta load/store
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if ((((op1 & 0b10010) == 0b00010) && op2 == 0b1011) || (((op1 & 0b10011) == 0b00011) && ((op2 & 0b1101) == (0b1101))))
                {
                   // extra load/store unprivileged
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
             }
             else
@@ -922,7 +1303,7 @@ int decode_instruction(instruction_t* instruction)
                      instruction->AND_I.d = (word >> 12) & 15;
                      instruction->AND_I.n = (word >> 16) & 15;
                      instruction->setflags = (word >> 20) & 1;
-                     instruction->AND_I.imm32 = ARMExpandImm_C(word & 0xfff, state.c, &instruction->AND_I.c);
+                     instruction->AND_I.imm32 = ARMExpandImm_C(word & 0xfff, DECODE_CARRY, &instruction->AND_I.c);
                      DECODED;
                   }
                   else if ((op & 0b11110) == 0b000010)
@@ -998,7 +1379,7 @@ int decode_instruction(instruction_t* instruction)
                      instruction->ORR_I.d = (word >> 12) & 15;
                      instruction->ORR_I.n = (word >> 16) & 15;
                      instruction->setflags = (word >> 2) & 1;
-                     instruction->ORR_I.imm32 = ARMExpandImm_C(word & 0xfff, state.c, &instruction->ORR_I.c);
+                     instruction->ORR_I.imm32 = ARMExpandImm_C(word & 0xfff, DECODE_CARRY, &instruction->ORR_I.c);
                      DECODED;
                   }
                   else if ((op & 0b11110) == 0b11010)
@@ -1006,7 +1387,7 @@ int decode_instruction(instruction_t* instruction)
                      instruction->opcode = MOV_I;
                      instruction->MOV_I.d = (word >> 12) & 15;
                      instruction->setflags = ((word >> 20) & 1) == 1;
-                     instruction->MOV_I.imm32 = ARMExpandImm_C(word & 0xfff, state.c, &instruction->MOV_I.c);
+                     instruction->MOV_I.imm32 = ARMExpandImm_C(word & 0xfff, DECODE_CARRY, &instruction->MOV_I.c);
                      DECODED;
                   }
                   else if ((op & 0b11110) == 0b11100)
@@ -1015,7 +1396,7 @@ int decode_instruction(instruction_t* instruction)
                      instruction->BIC_I.d = (word >> 12) & 15;
                      instruction->BIC_I.n = (word >> 16) & 15;
                      instruction->setflags = (word >> 20) & 1;
-                     instruction->BIC_I.imm32 = ARMExpandImm_C(word & 0xfff, state.c, &instruction->BIC_I.c);
+                     instruction->BIC_I.imm32 = ARMExpandImm_C(word & 0xfff, DECODE_CARRY, &instruction->BIC_I.c);
                      DECODED;
                   }
                   else if ((op & 0b11110) == 0b11110)
@@ -1023,7 +1404,7 @@ int decode_instruction(instruction_t* instruction)
                      instruction->opcode = MVN_I;
                      instruction->MVN_I.d = (word >> 12) & 15;
                      instruction->setflags = (word >> 20) & 1;
-                     instruction->MVN_I.imm32 = ARMExpandImm_C(word & 0xfff, state.c, &instruction->MVN_I.c);
+                     instruction->MVN_I.imm32 = ARMExpandImm_C(word & 0xfff, DECODE_CARRY, &instruction->MVN_I.c);
                      DECODED;
                   }                                    
                   ILLEGAL_OPCODE;
@@ -1050,7 +1431,7 @@ int decode_instruction(instruction_t* instruction)
                else if ((op1 & 0b11011) == 0b10010)
                {
                   // MSR (immediate) and hints
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
             }               
             ILLEGAL_OPCODE;
@@ -1089,9 +1470,9 @@ int decode_instruction(instruction_t* instruction)
                   uint8_t U = (word >> 23) & 1;
                   uint16_t imm12 = word & 0xfff;
                   uint8_t Rn = (word >> 16) & 15;
-                  assert(!(P == 0 && W == 1));
+                  DECODE_ASSERT(!(P == 0 && W == 1));
                   if (Rn == 13 && P == 0 && U == 1 && W == 0 && imm12 == 4)
-                     assert("Should be POP");
+                     DECODE_ASSERT("Should be POP");
                   instruction->opcode = LDR_I;
                   instruction->LDR_I.t = (word >> 12) & 15;
                   instruction->LDR_I.n = (word >> 16) & 15;
@@ -1115,7 +1496,7 @@ int decode_instruction(instruction_t* instruction)
                   if (P == W)
                      UNPREDICTABLE;
                   if (P == 0 && W == 1)
-                     assert("Should be LDRT");
+                     DECODE_ASSERT("Should be LDRT");
                   DECODED;
                }
             }
@@ -1165,22 +1546,22 @@ int decode_instruction(instruction_t* instruction)
             if ((op1 & 0b11100) == 0)
             {
                // Parallel addition and subtraction, signed
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op1 & 0b11100) == 0b00100)
             {
                // Parallel addition and subtraction, unsigned
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op1 & 0b11000) == 0b01000)
             {
                // Packing, unpacking, saturation, reversal
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op1 & 0b11000) == 0b10000)
             {
                // Signed multiply, signed and unsigned divide
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if (op1 == 0b11000 && op2 == 0b000)
             {
@@ -1334,7 +1715,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->MRC.opc2 = (word >> 5) & 7;
                   instruction->MRC.cm = word & 15;
                   instruction->MRC.cn = (word >> 16) & 15;
-                  if (instruction->MRC.t == 13 && state.t != 0)
+                  if (instruction->MRC.t == 13 && d->t != 0)
                      UNPREDICTABLE;
                   DECODED;
                }
@@ -1344,22 +1725,22 @@ int decode_instruction(instruction_t* instruction)
                if ((op1 & 0b100000) == 0 && !((op1 & 0b111010) == 0))
                {
                   // Extension register load/store
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if ((op1 & 0b111110) == 0b000100)
                {
                   // 64-bit transfers between ARM core and extension registers
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if (((op1 & 0b110000) == 0b100000) && op == 0)
                {
                   // Floating point data processing
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if (((op1 & 0b110000) == 0b100000) && op == 1)
                {
                   // 8, 16 and 32-bit transfer between ARM core and extension registers
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
             }
             ILLEGAL_OPCODE;
@@ -1374,7 +1755,7 @@ int decode_instruction(instruction_t* instruction)
          if ((op1 & 0b10000000) == 0)
          {
             // Memory hints, SIMD, and misc
-            assert(0);
+            DECODE_ASSERT(0);
          }
          else if ((op1 & 0b11100101) == 0b10000100)
          {
@@ -1391,23 +1772,28 @@ int decode_instruction(instruction_t* instruction)
             instruction->BL_I.imm32 = SignExtend(24, ((word & 0xffffff) << 2) | ((word >> 23) & 2), 32);
             DECODED;
          }
-         assert(0); // STC, STC2, LDC_I, LDC2_I, LDC_L, LDC2_L, MCRR, MCRR2, MRRC, MRRC2, CDP, CDP2, MCR, MCR2, MRC, MRC2
+         DECODE_ASSERT(0); // STC, STC2, LDC_I, LDC2_I, LDC_L, LDC2_L, MCRR, MCRR2, MRRC, MRRC2, CDP, CDP2, MCR, MCR2, MRC, MRC2
       }            
    }
-   else if (state.t) // THUMB node
+   else if (d->t) // THUMB node
    {
       instruction->condition = 14; // By default thumb instructions are always executed
-      uint16_t word = read_mem(2, state.next_instruction);
-      state.PC = state.next_instruction + 4;
-      state.next_instruction += 2;
+      uint32_t word32;
+      if (!fetch(d, 2, &word32))
+         return 0;
+      uint16_t word = word32;
+      d->pc = d->next_instruction + 4;
+      d->next_instruction += 2;
       if ((word >> 11 == 0b11101) || (word >> 11 == 0b11110) || (word >> 11 == 0b11111))
       {
          // 32-bit thumb
-         uint16_t word2 = read_mem(2, state.next_instruction);
+         if (!fetch(d, 2, &word32))
+            return 0;
+         uint16_t word2 = word32;
          instruction->this_instruction = (word << 16) | word2;
          instruction->this_instruction_length = 32;         
-         // Do NOT change state.PC here for a 2-cycle decode! 
-         state.next_instruction += 2;
+         // Do NOT change d->pc here for a 2-cycle decode! 
+         d->next_instruction += 2;
          uint8_t op1 = (word >> 11) & 3;
          uint8_t op2 = (word >> 4) & 127;
          uint8_t op = (word2 >> 15) & 1;
@@ -1456,8 +1842,8 @@ int decode_instruction(instruction_t* instruction)
                         instruction->opcode = POP;
                         instruction->POP.registers = word2;
                         instruction->POP.unaligned_allowed = 0;
-                        assert(BitCount(instruction->POP.registers) >= 2);
-                        assert((word2 >> 14) != 3);
+                        DECODE_ASSERT(BitCount(instruction->POP.registers) >= 2);
+                        DECODE_ASSERT((word2 >> 14) != 3);
                         // FIXME: Check IT stuff
                         DECODED;
                      }
@@ -1476,7 +1862,7 @@ int decode_instruction(instruction_t* instruction)
                         instruction->opcode = PUSH; // T2
                         instruction->PUSH.registers = word2;
                         instruction->PUSH.unaligned_allowed = 0;
-                        assert(BitCount(instruction->PUSH.registers) >= 2);
+                        DECODE_ASSERT(BitCount(instruction->PUSH.registers) >= 2);
                         DECODED;
                      }
                   }
@@ -1496,7 +1882,7 @@ int decode_instruction(instruction_t* instruction)
                      NOT_DECODED("RFE");
                   }
                }
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op2 & 0b1100100) == 0b0000100)
             {
@@ -1641,7 +2027,7 @@ int decode_instruction(instruction_t* instruction)
                else if ((op1 & 0b110000) == 0b110000)
                {
                   // Advanced SIMD
-                  assert(0);
+                  DECODE_ASSERT(0);
                }
                else if ((coproc & 0b1110) != 0b1010)
                {
@@ -1671,7 +2057,7 @@ int decode_instruction(instruction_t* instruction)
                      instruction->MRC.opc2 = (word2 >> 5) & 7;
                      instruction->MRC.cm = word2 & 15;
                      instruction->MRC.cn = word & 15;
-                     if (instruction->MRC.t == 13 && state.t != 0)
+                     if (instruction->MRC.t == 13 && d->t != 0)
                         UNPREDICTABLE;
                      DECODED;
                   }
@@ -1681,22 +2067,22 @@ int decode_instruction(instruction_t* instruction)
                   if ((op1 & 0b100000) == 0 && ((op1 & 0b111010) != 0))
                   {
                      // Extension register load/store
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                   else if ((op1 & 0b11110) == 0b000100)
                   {
                      // 64-bit transfers between ARM core and extension registers
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                   else if (((op1 & 0b110000) == 0b10000) && op == 0)
                   {
                      // Floating point data processing instructions
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                   else if (((op1 & 0b110000) == 0b100000) && op == 1)
                   {
                      // 8, 16, and 32-bit transfer between ARM core and extension registers
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                }
                ILLEGAL_OPCODE;
@@ -1716,7 +2102,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->setflags = (word >> 4) & 1;
                   instruction->AND_I.n = word & 15;
                   instruction->AND_I.d = (word2 >> 8) & 15;
-                  instruction->AND_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), state.c, &instruction->TST_I.c);
+                  instruction->AND_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), DECODE_CARRY, &instruction->TST_I.c);
                   if (instruction->AND_I.d == 13)
                      UNPREDICTABLE;
                   if (instruction->AND_I.d == 15 && instruction->setflags)
@@ -1729,8 +2115,8 @@ int decode_instruction(instruction_t* instruction)
                {  // T1
                   instruction->opcode = TST_I;
                   instruction->TST_I.n = word & 15;
-                  instruction->TST_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), state.c, &instruction->TST_I.c);
-                  assert(instruction->TST_I.n != 13 && instruction->TST_I.n != 15);
+                  instruction->TST_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), DECODE_CARRY, &instruction->TST_I.c);
+                  DECODE_ASSERT(instruction->TST_I.n != 13 && instruction->TST_I.n != 15);
                   DECODED;
                }
                else if (op == 1)
@@ -1739,7 +2125,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->BIC_I.d = (word2 >> 8) & 15;
                   instruction->BIC_I.n = word & 15;
                   instruction->setflags = (word >> 4) & 1;
-                  instruction->BIC_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), state.c, &instruction->BIC_I.c);
+                  instruction->BIC_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), DECODE_CARRY, &instruction->BIC_I.c);
                   if (instruction->BIC_I.d == 13 || instruction->BIC_I.d == 15 || instruction->BIC_I.n == 13 || instruction->BIC_I.n == 15)
                      UNPREDICTABLE;
                   DECODED;
@@ -1750,7 +2136,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->ORR_I.d = (word2 >> 8) & 15;
                   instruction->ORR_I.n = word & 15;
                   instruction->setflags = (word >> 4) & 1;
-                  instruction->ORR_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), state.c, &instruction->ORR_I.c);
+                  instruction->ORR_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), DECODE_CARRY, &instruction->ORR_I.c);
                   if (instruction->MOV_I.d == 13 || instruction->MOV_I.d == 15)
                      UNPREDICTABLE;
                   DECODED;
@@ -1760,7 +2146,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->opcode = MOV_I;
                   instruction->MOV_I.d = (word2 >> 8) & 15;
                   instruction->setflags = (word >> 4) & 1;
-                  instruction->MOV_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), state.c, &instruction->MOV_I.c);
+                  instruction->MOV_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), DECODE_CARRY, &instruction->MOV_I.c);
                   if (instruction->MOV_I.d == 13 || instruction->MOV_I.d == 15)
                      UNPREDICTABLE;
                   DECODED;
@@ -1774,7 +2160,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->opcode = MVN_I;
                   instruction->MVN_I.d = (word2 >> 8) & 15;
                   instruction->setflags = (word >> 4) & 1;
-                  instruction->MVN_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), state.c, &instruction->MVN_I.c);
+                  instruction->MVN_I.imm32 = ThumbExpandImm_C(((word << 16) | word2), DECODE_CARRY, &instruction->MVN_I.c);
                   if (instruction->MOV_I.d == 13 || instruction->MOV_I.d == 15)
                      UNPREDICTABLE;
                   DECODED;
@@ -1786,8 +2172,8 @@ int decode_instruction(instruction_t* instruction)
                   instruction->EOR_I.n = word & 15;
                   instruction->setflags = (word >> 4) & 1;
                   // FIXME: This is probably not right!
-                  instruction->EOR_I.imm32 = ThumbExpandImm_C((word2 & 255) | ((word2 >> 4) & 0x700) | ((word << 1) & 0x800), state.c, &instruction->EOR_I.c);
-                  assert(!(instruction->EOR_I.d == 13 || (instruction->EOR_I.d == 15 && instruction->setflags == 0) || instruction->EOR_I.n == 13 || instruction->EOR_I.n == 15));
+                  instruction->EOR_I.imm32 = ThumbExpandImm_C((word2 & 255) | ((word2 >> 4) & 0x700) | ((word << 1) & 0x800), DECODE_CARRY, &instruction->EOR_I.c);
+                  DECODE_ASSERT(!(instruction->EOR_I.d == 13 || (instruction->EOR_I.d == 15 && instruction->setflags == 0) || instruction->EOR_I.n == 13 || instruction->EOR_I.n == 15));
                   DECODED;
                }
                else if (op == 4 && RdS == 31)
@@ -1838,7 +2224,7 @@ int decode_instruction(instruction_t* instruction)
                }
 
                   
-               assert(0);
+               DECODE_ASSERT(0);
             }
             if (((op2 & 0b0100000) == 0b0100000) && op == 0)
             {
@@ -1880,7 +2266,7 @@ int decode_instruction(instruction_t* instruction)
                   instruction->opcode = MOVT;
                   instruction->MOVT.d = (word2 >> 8) & 15;
                   instruction->MOVT.imm16 = ((word2 & 255) | ((word2 >> 4) & 0x700) | ((word << 1) & 0x800) | ((word & 15) << 12));
-                  assert(instruction->MOVT.d != 13 && instruction->MOVT.d != 15);
+                  DECODE_ASSERT(instruction->MOVT.d != 13 && instruction->MOVT.d != 15);
                   DECODED;
                }
                else if (op == 0b10000 || op == 0b10010) // FIXME: Second case only applies if word:[14:12, 7:6] != 0
@@ -1958,12 +2344,12 @@ int decode_instruction(instruction_t* instruction)
                   else if (op == 0b0111010)
                   {
                      // CPS, and hints
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                   else if (op == 0b0111011)
                   {
                      // Misc control
-                     assert(0);
+                     DECODE_ASSERT(0);
                   }
                   else if (op == 0b01111000)
                   {
@@ -2010,7 +2396,7 @@ int decode_instruction(instruction_t* instruction)
                   uint8_t I2 = ~(J2 ^ S) & 1;
                   instruction->opcode = B;
                   instruction->B.imm32 = SignExtend(24, (S << 23) | (I1 << 22) | (I2 << 21) | ((word & 0x3ff) << 12) | ((word2 & 0x7ff) << 1), 32);
-                  if (state.itstate != 0) UNPREDICTABLE;
+                  if (DECODE_ITSTATE != 0) UNPREDICTABLE;
                   DECODED;
                }
                if (op1 == 0b010)
@@ -2029,7 +2415,7 @@ int decode_instruction(instruction_t* instruction)
                   uint8_t I2 = ~(J2 ^ S) & 1;
                   instruction->opcode = BLX_I;
                   instruction->BL_I.t = 0;
-                  assert((word2 & 1) != 1);
+                  DECODE_ASSERT((word2 & 1) != 1);
                   instruction->BL_I.imm32 = SignExtend(24, (S << 23) | (I1 << 22) | (I2 << 21) | ((word & 0x3ff) << 12) | ((word2 & 0x7ff) << 1), 32);
                   DECODED;
                }
@@ -2134,12 +2520,12 @@ int decode_instruction(instruction_t* instruction)
             else if ((op2 & 0b1100111) == 0b0000001)
             {
                // Load byte, memory hints
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op2 & 0b1100111) == 0b0000011)
             {
                // Load halfword, memory hints
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op2 & 0b1100111) == 0b0000101)
             {
@@ -2205,12 +2591,12 @@ int decode_instruction(instruction_t* instruction)
             else if ((op2 & 0b1110001) == 0b0010000)
             {
                // Advanced SIMD, or structure load/store
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op2 & 0b1110000) == 0b0100000)
             {
                // Data processing register
-               assert(0);
+               DECODE_ASSERT(0);
             }
             else if ((op2 & 0b1111000) == 0b0110000)
             {
@@ -2345,7 +2731,7 @@ int decode_instruction(instruction_t* instruction)
             else if ((op2 & 0b1000000) == 0b1000000)
             {
                // Coprocessor, Advanced SIMD and FP
-               assert(0);
+               DECODE_ASSERT(0);
             }
          }         
          ILLEGAL_OPCODE;
@@ -2394,7 +2780,7 @@ int decode_instruction(instruction_t* instruction)
                instruction->ADD_R.m = (word >> 6) & 7;
                instruction->ADD_R.shift_t = LSL;
                instruction->ADD_R.shift_n = 0;
-               instruction->setflags = (state.itstate == 0);
+               instruction->setflags = (DECODE_ITSTATE == 0);
                DECODED;
             }
             else if (opcode == 0b01111)
@@ -2410,9 +2796,9 @@ int decode_instruction(instruction_t* instruction)
             {
                instruction->opcode = MOV_I;
                instruction->MOV_I.d = (word >> 8) & 7;
-               instruction->MOV_I.c = state.c;
+               instruction->MOV_I.c = DECODE_CARRY;
                instruction->MOV_I.imm32 = word & 255;
-               instruction->setflags = (state.itstate == 0);
+               instruction->setflags = (DECODE_ITSTATE == 0);
                DECODED;
             }
             else if ((opcode & 0b11100) == 0b10100)
@@ -2785,7 +3171,7 @@ int decode_instruction(instruction_t* instruction)
                instruction->opcode = PUSH;
                instruction->PUSH.registers = (word & 255) | ((word & 256) << 6);
                instruction->PUSH.unaligned_allowed = 0;
-               assert(instruction->PUSH.registers != 0);
+               DECODE_ASSERT(instruction->PUSH.registers != 0);
                DECODED;
             }
             else if (opcode == 0b0110010)
@@ -2935,6 +3321,248 @@ int decode_instruction(instruction_t* instruction)
    ILLEGAL_OPCODE;
 }
 
+// Back to the machine state for everything else
+#undef IN_IT_BLOCK
+#undef LAST_IN_IT_BLOCK
+#undef ILLEGAL_OPCODE
+#undef NOT_DECODED
+#undef UNPREDICTABLE
+#undef UNDEFINED
+#undef DECODE_ASSERT
+#define IN_IT_BLOCK ((state.itstate & 15) != 0)
+#define LAST_IN_IT_BLOCK ((state.itstate & 15) == 8)
+#define ILLEGAL_OPCODE assert(0 && "Illegal opcode")
+#define NOT_DECODED(t) not_decoded(t, __LINE__)
+#define UNPREDICTABLE assert(0 && "Unpredictable")
+#define UNDEFINED {printf("Permanently undefined instruction encountered\n"); exit(-1);}
+
+// Decoded instructions, direct mapped on address so that all the entries for one page sit together. Each entry is guarded by a
+// sequence number (odd while it is being written), since the pre-decoder may be filling entries in from another thread
+#define DECODE_CACHE_BITS 16
+#define GUEST_PAGES (0x100000000ull / VPAGE_SIZE)
+
+typedef struct
+{
+   uint32_t sequence;
+   uint32_t tag;                 // Address | Thumb
+   uint32_t generation;          // Of the page the instruction is in, when it was decoded
+   uint8_t depends_on_state;
+   uint8_t c;
+   uint8_t itstate;
+   instruction_t instruction;
+} decoded_t;
+
+__thread decoded_t* decode_cache = NULL;
+__thread uint64_t decode_cache_hits = 0;
+
+void enable_decode_cache()
+{
+   decode_cache = calloc(sizeof(decoded_t), 1 << DECODE_CACHE_BITS);
+   page_generations = calloc(sizeof(uint32_t), GUEST_PAGES);
+}
+
+void cache_decoded(decoded_t* cache, uint32_t address, decoder_t* d, instruction_t* instruction, uint32_t generation)
+{
+   // Instructions that straddle two pages are not worth the trouble
+   if (address / VPAGE_SIZE != (address + instruction->this_instruction_length / 8 - 1) / VPAGE_SIZE)
+      return;
+   decoded_t* e = &cache[(address >> 1) & ((1 << DECODE_CACHE_BITS) - 1)];
+   uint32_t sequence = __atomic_load_n(&e->sequence, __ATOMIC_RELAXED);
+   // If the other thread is writing this entry, let it have it
+   if ((sequence & 1) || !__atomic_compare_exchange_n(&e->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return;
+   e->tag = address | d->t;
+   e->generation = generation;
+   e->depends_on_state = d->depends_on_state;
+   e->c = d->c;
+   e->itstate = d->itstate;
+   e->instruction = *instruction;
+   __atomic_store_n(&e->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int lookup_decoded(uint32_t address, instruction_t* instruction)
+{
+   decoded_t* e = &decode_cache[(address >> 1) & ((1 << DECODE_CACHE_BITS) - 1)];
+   uint32_t sequence = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+   if (sequence == 0 || (sequence & 1) || e->tag != (address | state.t))
+      return 0;
+   if (e->generation != __atomic_load_n(&page_generations[address / VPAGE_SIZE], __ATOMIC_ACQUIRE))
+      return 0;
+   if (e->depends_on_state && (e->c != state.c || e->itstate != state.itstate))
+      return 0;
+   *instruction = e->instruction;
+   // If the entry changed while we were copying it, we might have half of each
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   if (__atomic_load_n(&e->sequence, __ATOMIC_RELAXED) != sequence)
+      return 0;
+   state.PC = address + (state.t?4:8);
+   state.next_instruction = address + instruction->this_instruction_length / 8;
+   decode_cache_hits++;
+   return 1;
+}
+
+int decode_instruction(instruction_t* instruction)
+{
+   uint32_t address = state.next_instruction;
+   uint32_t generation = 0;
+   if (decode_cache != NULL)
+   {
+      if (lookup_decoded(address, instruction))
+         return 1;
+      generation = __atomic_load_n(&page_generations[address / VPAGE_SIZE], __ATOMIC_ACQUIRE);
+   }
+   decoder_t d;
+   memset(&d, 0, sizeof(decoder_t));
+   d.next_instruction = address;
+   d.t = state.t;
+   d.c = state.c;
+   d.itstate = state.itstate;
+   int result = decode(&d, instruction);
+   state.PC = d.pc;
+   state.next_instruction = d.next_instruction;
+   if (result && decode_cache != NULL)
+      cache_decoded(decode_cache, address, &d, instruction, generation);
+   return result;
+}
+
+// The pre-decoder. As images are loaded, the entry points of their functions are queued up here, and a worker thread decodes the
+// first block of each into the decode cache while the main thread gets on with binding and running initializers. There is one worker
+// for the whole process, so each job says which machine's cache it is for
+#define MAX_PREDECODE_BLOCK 64
+
+typedef struct
+{
+   decoded_t* cache;
+   uint32_t* generations;
+   uint32_t address;
+   uint8_t thumb;
+   unsigned char* code;
+   uint32_t code_address;
+   uint32_t code_length;
+} predecode_job_t;
+
+uint8_t predecoding = 0;
+predecode_job_t* predecode_jobs = NULL;
+uint32_t predecode_job_count = 0;
+uint32_t predecode_job_capacity = 0;
+uint32_t next_predecode_job = 0;
+pthread_mutex_t predecode_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t predecode_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t predecode_done = PTHREAD_COND_INITIALIZER;
+decoded_t* predecode_busy_with = NULL;   // The cache of the job the worker is on, if any
+pthread_t predecode_thread;
+
+int ends_block(opcode_t opcode)
+{
+   switch(opcode)
+   {
+      case B: case BL_I: case BLX_I: case BL_R: case BLX_R: case BX: case CBZ: case CBNZ: case POP: case LDM: case BKPT: case SVC: case UDF:
+         return 1;
+      default:
+         return 0;
+   }
+}
+
+void predecode_block(predecode_job_t* job)
+{
+   decoder_t d;
+   memset(&d, 0, sizeof(decoder_t));
+   d.next_instruction = job->address;
+   d.t = job->thumb;
+   d.speculative = 1;
+   d.code = job->code;
+   d.code_address = job->code_address;
+   d.code_length = job->code_length;
+   for (int i = 0; i < MAX_PREDECODE_BLOCK; i++)
+   {
+      uint32_t address = d.next_instruction;
+      uint32_t generation = __atomic_load_n(&job->generations[address / VPAGE_SIZE], __ATOMIC_ACQUIRE);
+      instruction_t instruction;
+      memset(&instruction, 0, sizeof(instruction_t));
+      if (!decode(&d, &instruction))
+         return;
+      cache_decoded(job->cache, address, &d, &instruction, generation);
+      if (ends_block(instruction.opcode))
+         return;
+   }
+}
+
+void* predecode_worker(void* unused)
+{
+   pthread_mutex_lock(&predecode_lock);
+   while (1)
+   {
+      while (next_predecode_job == predecode_job_count)
+         pthread_cond_wait(&predecode_ready, &predecode_lock);
+      predecode_job_t job = predecode_jobs[next_predecode_job++];
+      predecode_busy_with = job.cache;
+      pthread_mutex_unlock(&predecode_lock);
+      predecode_block(&job);
+      pthread_mutex_lock(&predecode_lock);
+      predecode_busy_with = NULL;
+      pthread_cond_broadcast(&predecode_done);
+   }
+   return NULL;
+}
+
+// Turns on the decode cache for this machine, and starts the worker if nobody has yet
+void start_predecoder()
+{
+   enable_decode_cache();
+   pthread_mutex_lock(&predecode_lock);
+   if (!predecoding)
+   {
+      predecoding = 1;
+      pthread_create(&predecode_thread, NULL, predecode_worker, NULL);
+   }
+   pthread_mutex_unlock(&predecode_lock);
+}
+
+// Drops whatever is still queued for this machine, and waits for the worker to be done with its decode cache
+void forget_predecode_jobs()
+{
+   pthread_mutex_lock(&predecode_lock);
+   uint32_t kept = next_predecode_job;
+   for (uint32_t i = next_predecode_job; i < predecode_job_count; i++)
+   {
+      if (predecode_jobs[i].cache != decode_cache)
+         predecode_jobs[kept++] = predecode_jobs[i];
+   }
+   predecode_job_count = kept;
+   while (predecode_busy_with != NULL && predecode_busy_with == decode_cache)
+      pthread_cond_wait(&predecode_done, &predecode_lock);
+   pthread_mutex_unlock(&predecode_lock);
+}
+
+// Only machines that have a decode cache of their own get anything from the worker, whoever started it
+int predecode_enabled()
+{
+   return predecoding && decode_cache != NULL;
+}
+
+// code must stay mapped (and hold code_length bytes from code_address) for as long as the machine runs
+void predecode(uint32_t address, uint8_t thumb, unsigned char* code, uint32_t code_address, uint32_t code_length)
+{
+   if (!predecode_enabled())
+      return;
+   pthread_mutex_lock(&predecode_lock);
+   if (predecode_job_count == predecode_job_capacity)
+   {
+      predecode_job_capacity = (predecode_job_capacity == 0)?1024:(predecode_job_capacity * 2);
+      predecode_jobs = realloc(predecode_jobs, sizeof(predecode_job_t) * predecode_job_capacity);
+   }
+   predecode_job_t* job = &predecode_jobs[predecode_job_count++];
+   job->cache = decode_cache;
+   job->generations = page_generations;
+   job->address = address;
+   job->thumb = thumb;
+   job->code = code;
+   job->code_address = code_address;
+   job->code_length = code_length;
+   pthread_cond_signal(&predecode_ready);
+   pthread_mutex_unlock(&predecode_lock);
+}
+
 uint32_t ror32(uint32_t value, int degree)
 {
    return (value >> degree) | (value << (32 - degree));
@@ -2963,8 +3591,8 @@ int condition_passed(uint8_t condition)
 }
 
 #ifdef WITH_FUNCTION_LABELS
-char* current_module = "unknown";
-char* current_function = "<unknown>";
+__thread char* current_module = "unknown";
+__thread char* current_function = "<unknown>";
 void branch_detected(uint32_t to_address)
 {
    if (!lookup_function(to_address, &current_module, &current_function))
@@ -2979,13 +3607,134 @@ void print_opcode(instruction_t* instruction)
 {
    printf("     %08x # %s%s%s", instruction->source_address, opcode_name[instruction->opcode], condition_name[instruction->condition], instruction->setflags?"s":"");
 }
-void step_machine(int steps)
+
+char* exit_reason_name[] = {"returned to hypervisor", "process exited", "instruction budget exhausted", "time budget exhausted", "unimplemented stub called", "undefined instruction", "unresolved symbol", "could not be loaded"};
+
+__thread uint64_t instructions_executed = 0;
+__thread uint32_t exit_status = 0;
+__thread uint8_t exit_requested = 0;
+// Set when something run on the guest's behalf (a resolver or an initializer) did not return. Whatever was waiting on it cannot go on
+// either, so the run stops at the next block, for the same reason
+__thread uint8_t stop_requested = 0;
+__thread exit_reason_t stop_reason = EXIT_HYPERVISOR_RETURN;
+
+// Budgets are only checked when control flow is redirected (ie at the end of a basic block), since straight-line code cannot run forever
+__thread uint64_t instruction_budget = 0;  // 0 means unlimited
+__thread double time_budget = 0;           // in seconds. 0 means unlimited
+__thread struct timespec start_time;
+__thread uint32_t blocks_since_clock_check = 0;
+#define CLOCK_CHECK_INTERVAL 1024
+
+void set_instruction_budget(uint64_t instructions)
+{
+   instruction_budget = instructions;
+}
+
+void set_time_budget(double seconds)
+{
+   time_budget = seconds;
+   clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+// Each job run by the fork server (or call made through armulator.h) starts out not having exited, and gets the whole of the budgets to itself
+void restart_budgets()
+{
+   exit_status = 0;
+   exit_requested = 0;
+   stop_requested = 0;
+   instructions_executed = 0;
+   blocks_since_clock_check = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+void machine_exit(uint32_t status)
 {
-   for (int step = 0; step < steps; step++)
+   exit_status = status;
+   exit_requested = 1;
+}
+
+void stop_machine(exit_reason_t reason)
+{
+   if (stop_requested)
+      return;
+   stop_requested = 1;
+   stop_reason = reason;
+}
+
+int machine_stopped(exit_reason_t* reason)
+{
+   if (stop_requested && reason != NULL)
+      *reason = stop_reason;
+   return stop_requested;
+}
+
+void report_exit(exit_reason_t reason)
+{
+   if (reason == EXIT_PROCESS_EXIT)
+      printf("Execution stopped: %s with status %d after %llu instructions\n", exit_reason_name[reason], exit_status, instructions_executed);
+   else
+      printf("Execution stopped: %s after %llu instructions\n", exit_reason_name[reason], instructions_executed);
+   if (decode_cache != NULL)
+      printf("%llu instructions came from the decode cache\n", decode_cache_hits);
+}
+
+int budget_exhausted(exit_reason_t* reason)
+{
+   if (instruction_budget != 0 && instructions_executed >= instruction_budget)
+   {
+      *reason = EXIT_INSTRUCTION_BUDGET;
+      return 1;
+   }
+   // Reading the clock is comparatively expensive, so only do it every few blocks
+   if (time_budget != 0 && ++blocks_since_clock_check >= CLOCK_CHECK_INTERVAL)
    {
+      struct timespec now;
+      blocks_since_clock_check = 0;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9 >= time_budget)
+      {
+         *reason = EXIT_TIME_BUDGET;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// How many step_machine()s are in progress. Anything more than one is a call made (by the loader) from inside a running guest
+__thread uint32_t machine_depth = 0;
+
+exit_reason_t run_machine();
+
+// Runs until the program exits, we return to the hypervisor, or a budget runs out
+exit_reason_t step_machine()
+{
+   machine_depth++;
+   exit_reason_t reason = run_machine();
+   machine_depth--;
+   return reason;
+}
+
+exit_reason_t run_machine()
+{
+   uint32_t fallthrough = state.next_instruction;
+   while (1)
+   {
+      if (state.next_instruction != fallthrough)
+      {
+         // Control flow was redirected by the last instruction, so this is a block boundary
+         exit_reason_t reason;
+         if (budget_exhausted(&reason))
+            return reason;
+         if (stop_requested)
+            return stop_reason;
+         if (coverage_map != NULL)
+            record_edge(state.next_instruction);
+      }
       instruction_t instruction;
       memset(&instruction, 0, sizeof(instruction_t));
       assert(decode_instruction(&instruction));
+      fallthrough = state.next_instruction;
+      instructions_executed++;
       if (state.t == 1 && state.itstate != 0)
       {
          // Update the condition based on itstate
@@ -3007,7 +3756,7 @@ void step_machine(int steps)
          }
       }
 
-      printf("    %04d%s: ", step, state.t==0?"A":"T");
+      printf("    %04llu%s: ", instructions_executed, state.t==0?"A":"T");
 #ifdef WITH_FUNCTION_LABELS
       printf("<%-30.30s> %-30.30s:", current_module, current_function);
 #endif
@@ -3655,21 +4404,30 @@ void step_machine(int steps)
             if (instruction.source_address == 0xfffffff0)
             {
                // Hypervisor return
-               return;
+               return EXIT_HYPERVISOR_RETURN;
             }
             breakpoint_t* breakpoint = find_breakpoint(instruction.source_address);
+            if (breakpoint->lazy_pointer != 0)
+            {
+               // First call through a lazy pointer. Bind it, then carry on into the real function with the arguments untouched
+               uint32_t target;
+               if (!bind_lazy_pointer(breakpoint, &target))
+                  return stop_requested?stop_reason:EXIT_UNRESOLVED_SYMBOL;
+               LOAD_PC(target);
+               break;
+            }
             if (breakpoint->handler != NULL)
             {
-               printf("Calling stub for %s\n", breakpoint->symbol_name);
+               printf("Calling stub for %s\n", breakpoint->symbol->name);
                state.r[0] = breakpoint->handler();
-               printf("Returning from stub for %s\n", breakpoint->symbol_name);
+               printf("Returning from stub for %s\n", breakpoint->symbol->name);
                LOAD_PC(state.LR);
                break;
             }
             else
             {
-               printf("   *** Not implemented: %s\n", breakpoint->symbol_name);
-               exit(0);
+               printf("   *** Not implemented: %s\n", breakpoint->symbol->name);
+               return EXIT_UNIMPLEMENTED_STUB;
             }
          }
          case IT:
@@ -3834,6 +4592,8 @@ void step_machine(int steps)
             {
                // CHECKME: Erm, does SVC set r0? I think it must. It MAY also set other things... hmm.
                state.r[0] = syscall(state.r[12]);
+               if (exit_requested)
+                  return EXIT_PROCESS_EXIT;
             }
             break;
          }
@@ -3929,7 +4689,7 @@ void step_machine(int steps)
          {
             printf(" 0x%08x\n", instruction.UDF.imm32);
             printf("    .... Undefined instruction encountered\n");
-            exit(-1);
+            return EXIT_UNDEFINED_INSTRUCTION;
          }
          default:
             assert(0 && "Opcode not implemented");
@@ -3950,25 +4710,46 @@ void restore_state(state_t* src)
    memcpy(&state, src, sizeof(state_t));
 }
 
+// Room left untouched below the interrupted frame, since leaf functions may use the stack under SP without moving it
+#define NESTED_CALL_RED_ZONE 256
+
 void allocate_stack()
 {
-   state.SP = 0xd0000000; // FIXME: CRITICAL: Nope!
+   // A resolver or initializer that runs while the guest is running (because binding or loading is lazy) must not land on the frames
+   // of the code it interrupted, so it goes below them. Otherwise nothing is live, and we start from the top
+   if (machine_depth > 0)
+      state.SP = (state.SP - NESTED_CALL_RED_ZONE) & ~7;
+   else
+      state.SP = 0xd0000000;
 }
 
-uint32_t _execute_function(int argc, ...)
+// Runs the function at address until it returns to us, and then puts the registers back as they were. The first four arguments are passed
+// in registers and the rest on the stack. If it did return, *result is what it left in r0
+exit_reason_t call_function(uint32_t address, uint32_t argc, uint32_t* args, uint32_t* result)
 {
-   va_list args;
    state_t state_copy;
-   uint32_t address;
-   assert(argc > 0);
+   if (isolate_calls && !tracking_writes && load_dylibs_lazily)
+   {
+      // Anything loaded during the call would have its initializers undone along with it, so load it all now, unisolated
+      isolate_calls = 0;
+      load_remaining_dylibs();
+      isolate_calls = 1;
+   }
+   // Only the outermost call is isolated. Anything it calls back into is undone along with it
+   uint8_t isolated = isolate_calls && !tracking_writes;
    
+   if (isolated)
+   {
+      start_tracking_writes();
+      coverage_start_run();
+   }
    save_state(&state_copy);
    allocate_stack();
-   va_start(args, argc);
-   address = va_arg(args, uint32_t);
+   // A guest that exited last time round has not exited this time
+   exit_status = 0;
+   exit_requested = 0;
    printf("Address: %08x\n", address);
    LOAD_PC(address);
-   argc--;
    if (argc > 4)
       state.SP -= (4 * (argc - 4)); // Make space on the stack if needed
    printf("Argc: %d (executing from address %08x)\n", argc, address);
@@ -3976,41 +4757,112 @@ uint32_t _execute_function(int argc, ...)
    {
       if (i < 4)
       {  // First 4 args in registers
-         state.r[i] = va_arg(args, uint32_t);
+         state.r[i] = args[i];
       }
       else
-      {  // Remaining args on the stack
-         write_mem(4, state.SP, va_arg(args, uint32_t));
-         state.SP += 4;
+      {  // Remaining args on the stack, the fifth at SP. SP itself stays where it is
+         write_mem(4, state.SP + 4 * (i - 4), args[i]);
       }         
    }
-   va_end(args);   
    state.LR = 0xfffffff0; // Return to hypervisor break
-   step_machine(3000); // FIXME: Not 3000, until we return!
-   uint32_t retval = state.r[0]; // Return r0
+   exit_reason_t reason = step_machine();
+   if (reason == EXIT_HYPERVISOR_RETURN)
+      *result = state.r[0]; // Return r0
    restore_state(&state_copy);   // After restoring the state. Note that we may not actually have to do this....
-   return retval;
+   if (isolated)
+      undo_tracked_writes();
+   return reason;
 }
 
-int main(int argc, char** argv)
+uint32_t _execute_function(int argc, ...)
 {
-   if (argc != 2)
+   va_list args;
+   uint32_t values[argc];
+   uint32_t address;
+   uint32_t retval;
+   assert(argc > 0);
+   va_start(args, argc);
+   address = va_arg(args, uint32_t);
+   for (int i = 0; i < argc - 1; i++)
+      values[i] = va_arg(args, uint32_t);
+   va_end(args);   
+   exit_reason_t reason = call_function(address, argc - 1, values, &retval);
+   if (reason != EXIT_HYPERVISOR_RETURN)
    {
-      printf("Usage: %s <executable>\n", argv[0]);
-      return -1;
+      // There is nothing sensible to return to, so the whole run is over. Callers must check machine_stopped()
+      printf("Function at %08x did not return: %s\n", address, exit_reason_name[reason]);
+      stop_machine(reason);
+      return 0;
    }
-   configure_hardware();
-   configure_coprocessors();
-   initialize_state();
-   prepare_loader();
-   register_stubs();
-   load_executable(argv[1]);
-   dump_symtab();
-   state.next_instruction = state.PC;
-   state.PC = 0;
-   printf("Memory mapped. Starting execution at %08x\n", state.next_instruction);
-   step_machine(600);
-   printf("Finished stepping\n");
-   return 0;
+   return retval;
+}
+
+// Gives back everything the machine on this thread has, and puts it back as it was before initialize_state(), so that the thread can
+// start another one. Images, symbols and the like belong to their own modules, which release them separately
+void free_machine()
+{
+   forget_predecode_jobs();
+   unmap_all_memory();
+   free(decode_cache);
+   free(page_generations);
+   free(dirty_bitmap);
+   free(dirty_pages);
+   free(dirty_originals);
+   decode_cache = NULL;
+   page_generations = NULL;
+   dirty_bitmap = NULL;
+   dirty_pages = NULL;
+   dirty_originals = NULL;
+   dirty_count = 0;
+   dirty_capacity = 0;
+   isolate_calls = 0;
+   tracking_writes = 0;
+   memset(&state, 0, sizeof(state_t));
+   machine_depth = 0;
+   next_page = 0x80000000;
+   decode_cache_hits = 0;
+   instructions_executed = 0;
+   exit_status = 0;
+   exit_requested = 0;
+   stop_requested = 0;
+   instruction_budget = 0;
+   time_budget = 0;
+   blocks_since_clock_check = 0;
+#ifdef WITH_FUNCTION_LABELS
+   current_module = "unknown";
+   current_function = "<unknown>";
+#endif
 }
 
+void machine_context(context_t* c)
+{
+   CONTEXT_VAR(c, page_tables);
+   CONTEXT_VAR(c, page_index);
+   CONTEXT_VAR(c, page_splits);
+   CONTEXT_VAR(c, state);
+   CONTEXT_VAR(c, next_page);
+   CONTEXT_VAR(c, page_generations);
+   CONTEXT_VAR(c, isolate_calls);
+   CONTEXT_VAR(c, tracking_writes);
+   CONTEXT_VAR(c, dirty_bitmap);
+   CONTEXT_VAR(c, dirty_pages);
+   CONTEXT_VAR(c, dirty_originals);
+   CONTEXT_VAR(c, dirty_count);
+   CONTEXT_VAR(c, dirty_capacity);
+   CONTEXT_VAR(c, decode_cache);
+   CONTEXT_VAR(c, decode_cache_hits);
+#ifdef WITH_FUNCTION_LABELS
+   CONTEXT_VAR(c, current_module);
+   CONTEXT_VAR(c, current_function);
+#endif
+   CONTEXT_VAR(c, instructions_executed);
+   CONTEXT_VAR(c, exit_status);
+   CONTEXT_VAR(c, exit_requested);
+   CONTEXT_VAR(c, stop_requested);
+   CONTEXT_VAR(c, stop_reason);
+   CONTEXT_VAR(c, instruction_budget);
+   CONTEXT_VAR(c, time_budget);
+   CONTEXT_VAR(c, start_time);
+   CONTEXT_VAR(c, blocks_since_clock_check);
+   CONTEXT_VAR(c, machine_depth);
+}
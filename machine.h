@@ -2,14 +2,46 @@
 
 
 #include <stdint.h>
+
+// A region of guest memory, and where it lives in ours
+struct page_table_t
+{
+   unsigned char* data;
+   uint32_t address;
+   uint32_t length;
+   void (*fixup)(uint32_t page);   // If set, this is called the first time each page of the region is touched
+   uint8_t* unfixed;               // One bit per page touched by the region, set until the fixup has been run for that page
+   uint8_t owned;                  // data came from map_new_memory(), and goes when the region does
+   uint8_t mapped;                 // data was mmap()ed for this region alone (as by load_snapshot()), and is unmapped with it
+   struct page_table_t* next;
+};
+
+typedef struct page_table_t page_table_t;
+
+// Everything that makes up a machine is thread-local, and is swapped in and out as the machine moves between threads (see context.h)
+extern __thread page_table_t* page_tables;   // Newest first
+extern __thread uint32_t next_page;
+void unmap_all_memory();
 void map_memory(unsigned char* data, uint32_t address, uint32_t length);
+unsigned char* map_new_memory(uint32_t address, uint32_t length);
+void map_memory_with_fixup(unsigned char* data, uint32_t address, uint32_t length, void (*fixup)(uint32_t page));
+unsigned char* map_range(uint32_t addr, uint32_t* length);
+unsigned char* map_range_for_write(uint32_t addr, uint32_t* length);
+void range_written(uint32_t addr);
+int range_is_mapped(uint32_t address, uint32_t length);
 void write_mem(uint8_t count, uint32_t addr, uint64_t value);
 uint64_t read_mem(uint8_t count, uint32_t addr);
 uint32_t alloc_page();
+extern uint8_t predecoding;
+void start_predecoder();
+int predecode_enabled();
+void predecode(uint32_t address, uint8_t thumb, unsigned char* code, uint32_t code_address, uint32_t code_length);
 #define NUMARGS(...)  (sizeof((int[]){__VA_ARGS__})/sizeof(int))
 #define execute_function(...)  _execute_function(NUMARGS(__VA_ARGS__), __VA_ARGS__)
 // The above lets you call execute_function(...) without passing the number of args specifically - the preprocessor will count them
 uint32_t _execute_function(int argc, ...);
+// Makes each execute_function() undo whatever it wrote to guest memory once it returns, so repeated calls all start from the same place
+void set_call_isolation(uint8_t on);
 
 typedef struct
 {
@@ -19,7 +51,39 @@ typedef struct
    uint32_t r[16];
 } state_t;
 
-extern state_t state;
+extern __thread state_t state;
+
+void initialize_state();
+void free_machine();
+
+typedef enum
+{
+   EXIT_HYPERVISOR_RETURN = 0,
+   EXIT_PROCESS_EXIT,
+   EXIT_INSTRUCTION_BUDGET,
+   EXIT_TIME_BUDGET,
+   EXIT_UNIMPLEMENTED_STUB,
+   EXIT_UNDEFINED_INSTRUCTION,
+   EXIT_UNRESOLVED_SYMBOL,
+   EXIT_LOAD_FAILED
+} exit_reason_t;
+
+extern char* exit_reason_name[];
+extern __thread uint64_t instructions_executed;
+extern __thread uint32_t exit_status;
+extern __thread uint64_t instruction_budget;
+
+exit_reason_t step_machine();
+// Unlike execute_function(), this hands back the reason if the function does not return, rather than ending the process
+exit_reason_t call_function(uint32_t address, uint32_t argc, uint32_t* args, uint32_t* result);
+void set_instruction_budget(uint64_t instructions);
+void set_time_budget(double seconds);
+void machine_exit(uint32_t status);
+// For when a call made on the guest's behalf fails: the run stops with this reason at the next block. Cleared by restart_budgets()
+void stop_machine(exit_reason_t reason);
+int machine_stopped(exit_reason_t* reason);
+void restart_budgets();
+void report_exit(exit_reason_t reason);
 
 #define PC r[15]
 #define SP r[13]
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "armulator.h"
+#include "machine.h"
+#include "loader.h"
+#include "dyld_cache.h"
+#include "snapshot.h"
+#include "fork_server.h"
+#include "coverage.h"
+
+void usage(char* name)
+{
+   printf("Usage: %s [--max-instructions <count>] [--max-seconds <seconds>] [--bind-now] [--lazy-dylibs] [--predecode] [--loader-threads <count>] [--sysroot <dir>]... [--cache-slide <bytes>] [--save-snapshot <file> [--snapshot-at <instructions>]] [--fork-server <socket>] [--coverage] [--coverage-module <name>]... <executable>\n       %s [options] --load-snapshot <file>\n", name, name);
+}
+
+int main(int argc, char** argv)
+{
+   char* executable = NULL;
+   char* snapshot_to_save = NULL;
+   char* snapshot_to_load = NULL;
+   char* fork_server_socket = NULL;
+   uint8_t coverage = 0;
+   uint8_t predecode = 0;
+   uint64_t snapshot_at = 0;
+   uint64_t max_instructions = 0;
+   double max_seconds = 0;
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "--max-instructions") == 0 && i+1 < argc)
+         max_instructions = strtoull(argv[++i], NULL, 0);
+      else if (strcmp(argv[i], "--max-seconds") == 0 && i+1 < argc)
+         max_seconds = strtod(argv[++i], NULL);
+      else if (strcmp(argv[i], "--bind-now") == 0)
+         bind_lazily = 0;
+      else if (strcmp(argv[i], "--lazy-dylibs") == 0)
+         load_dylibs_lazily = 1;
+      else if (strcmp(argv[i], "--predecode") == 0)
+         predecode = 1;
+      else if (strcmp(argv[i], "--loader-threads") == 0 && i+1 < argc)
+         loader_threads = strtoul(argv[++i], NULL, 0);
+      else if (strcmp(argv[i], "--sysroot") == 0 && i+1 < argc)
+         add_search_root(argv[++i]);
+      else if (strcmp(argv[i], "--cache-slide") == 0 && i+1 < argc)
+      {
+         cache_slide = strtoul(argv[++i], NULL, 0);
+         // Slide info describes whole pages, so a page of the guest must line up with a page of the cache
+         if (cache_slide % DYLD_CACHE_PAGE_SIZE != 0)
+         {
+            printf("The cache slide must be a multiple of %d\n", DYLD_CACHE_PAGE_SIZE);
+            return -1;
+         }
+      }
+      else if (strcmp(argv[i], "--save-snapshot") == 0 && i+1 < argc)
+         snapshot_to_save = argv[++i];
+      else if (strcmp(argv[i], "--load-snapshot") == 0 && i+1 < argc)
+         snapshot_to_load = argv[++i];
+      else if (strcmp(argv[i], "--snapshot-at") == 0 && i+1 < argc)
+         snapshot_at = strtoull(argv[++i], NULL, 0);
+      else if (strcmp(argv[i], "--fork-server") == 0 && i+1 < argc)
+         fork_server_socket = argv[++i];
+      else if (strcmp(argv[i], "--coverage") == 0)
+         coverage = 1;
+      else if (strcmp(argv[i], "--coverage-module") == 0 && i+1 < argc)
+      {
+         cover_module(argv[++i]);
+         coverage = 1;
+      }
+      else if (argv[i][0] != '-' && executable == NULL)
+         executable = argv[i];
+      else
+      {
+         usage(argv[0]);
+         return -1;
+      }
+   }
+   if ((executable == NULL) == (snapshot_to_load == NULL) || (snapshot_at != 0 && snapshot_to_save == NULL))
+   {
+      usage(argv[0]);
+      return -1;
+   }
+   if (coverage && !enable_coverage())
+      return -1;
+   // Everything below works on the machine's globals directly, so it stays in place for good
+   armulator_t* machine = armulator_create();
+   armulator_hold(machine);
+   armulator_set_budget(machine, max_instructions, max_seconds);
+   if (predecode)
+      start_predecoder();
+   exit_reason_t reason = (snapshot_to_load != NULL)?armulator_load_snapshot(machine, snapshot_to_load):armulator_load(machine, executable);
+   if (reason != EXIT_HYPERVISOR_RETURN)
+   {
+      report_exit(reason);
+      return (reason == EXIT_PROCESS_EXIT)?armulator_exit_status(machine):-1;
+   }
+   if (fork_server_socket != NULL)
+      return run_fork_server(fork_server_socket);
+   printf("Memory mapped. Starting execution at %08x\n", state.next_instruction);
+   if (snapshot_to_save != NULL && snapshot_at > instructions_executed)
+   {
+      // Run up to the snapshot point as if that were the budget (or to the real budget, if that comes first), then carry on
+      uint64_t budget = instruction_budget;
+      set_instruction_budget((budget != 0 && budget < snapshot_at)?budget:snapshot_at);
+      reason = armulator_run(machine);
+      set_instruction_budget(budget);
+      if (reason == EXIT_INSTRUCTION_BUDGET && (budget == 0 || instructions_executed < budget))
+      {
+         if (!save_snapshot(snapshot_to_save))
+         {
+            armulator_destroy(machine);
+            return -1;
+         }
+         reason = armulator_run(machine);
+      }
+   }
+   else
+   {
+      if (snapshot_to_save != NULL && !save_snapshot(snapshot_to_save))
+      {
+         armulator_destroy(machine);
+         return -1;
+      }
+      reason = armulator_run(machine);
+   }
+   report_exit(reason);
+   uint32_t status = armulator_exit_status(machine);
+   armulator_destroy(machine);
+   if (reason == EXIT_PROCESS_EXIT)
+      return status;
+   return (reason == EXIT_HYPERVISOR_RETURN)?0:-1;
+}
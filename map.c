@@ -1,15 +1,20 @@
-// Simple map interface. Initially a linked list, but could make this into a hashtable when I get time
+// Simple map interface. This is an open-addressing hashtable: the entries themselves live in one dense pool (in insertion order)
+// and the table just holds indices into that pool. Each entry remembers its hash, so growing the table never needs to rehash a key
+// and most mismatches during a probe are rejected without calling the comparator
 #include <stdlib.h>
 #include <string.h>
+#include "map.h"
+#include "intern.h"
 
-#define INITIAL_MAP_SIZE 65535
+#define INITIAL_MAP_SIZE 64    // Must be a power of two
+#define MAX_LOAD_PERCENT 70
 
 // djb2
 uint32_t djb2(void *ptr)
 {
    unsigned char* str = (unsigned char*)ptr;
    uint32_t hash = 5381;
-   int c;    
+   int c;
    while ((c = *str++))
       hash = ((hash << 5) + hash) + c;
    return hash;
@@ -20,36 +25,50 @@ int string_comparator(void* a, void* b)
    return strcmp((const char*)a, (const char*)b);
 }
 
+uint32_t symbol_hash(void* ptr)
+{
+   return ((symbol_t)ptr)->hash;
+}
 
-struct map_entry_t
+// Interned symbols are equal exactly when they are the same object
+int symbol_comparator(void* a, void* b)
 {
-   uint32_t hashkey;
-   char* key;
-   void* value;
-   struct map_entry_t* next;
-};
+   return a != b;
+}
 
-typedef struct map_entry_t map_entry_t;
 
 typedef struct
 {
-   map_entry_t** entries;
+   uint32_t hashkey;
+   void* key;
+   void* value;
+} map_entry_t;
+
+struct map_t
+{
+   map_entry_t* entries;    // Dense pool of entries
+   uint32_t* slots;         // 0 is an empty slot, otherwise the index of the entry + 1
    void (*free_fn)(void*);
+   void (*free_key)(void*);
    uint32_t (*hash_fn)(void*);
    int (*comparator)(void*, void*);
-   uint32_t size;
-   uint32_t usage;
-} map_t;
+   uint32_t size;           // Number of slots
+   uint32_t usage;          // Number of entries
+   uint32_t capacity;       // Number of entries the pool can hold before it must be grown
+};
 
 map_t* alloc_map(void (*free_fn)(void*), uint32_t (*hash_fn)(void* ptr), int (*comparator)(void*, void*))
 {
    map_t* map = malloc(sizeof(map_t));
    map->size = INITIAL_MAP_SIZE;
    map->usage = 0;
+   map->capacity = (INITIAL_MAP_SIZE * MAX_LOAD_PERCENT) / 100;
    map->free_fn = free_fn;
+   map->free_key = free;
    map->hash_fn = hash_fn;
    map->comparator = comparator;
-   map->entries = calloc(sizeof(map_entry_t), map->size);
+   map->slots = calloc(sizeof(uint32_t), map->size);
+   map->entries = malloc(sizeof(map_entry_t) * map->capacity);
    return map;
 }
 
@@ -58,58 +77,89 @@ map_t* alloc_char_map(void (*free_fn)(void*))
    return alloc_map(free_fn, djb2, string_comparator);
 }
 
+// Keys are symbol_t handles from intern(). They are not copied and are never freed by the map
+map_t* alloc_symbol_map(void (*free_fn)(void*))
+{
+   map_t* map = alloc_map(free_fn, symbol_hash, symbol_comparator);
+   map->free_key = NULL;
+   return map;
+}
+
 void free_map(map_t* m)
 {
-   for (int i = 0; i < m->size; i++)
+   for (int i = 0; i < m->usage; i++)
    {
-      for (map_entry_t* e = m->entries[i]; e; )
-      {
-         map_entry_t* f = e->next;
-         free(e->key);
-         if (m->free_fn)
-            m->free_fn(e->value);
-         free(e);
-         e = f;
-      }
+      if (m->free_key)
+         m->free_key(m->entries[i].key);
+      if (m->free_fn)
+         m->free_fn(m->entries[i].value);
    }
+   free(m->entries);
+   free(m->slots);
+   free(m);
 }
 
-map_entry_t* find_entry(map_t* m, char* key)
+map_entry_t* find_entry(map_t* m, void* key, uint32_t hashkey)
 {
-   uint32_t hashkey = m->hash_fn(key) % m->size;
-   for (map_entry_t* e = m->entries[hashkey]; e; e = e->next)
+   uint32_t mask = m->size - 1;
+   for (uint32_t i = hashkey & mask; m->slots[i] != 0; i = (i + 1) & mask)
    {
-      if (m->comparator(e->key, key) == 0)
-      {
+      map_entry_t* e = &m->entries[m->slots[i] - 1];
+      if (e->hashkey == hashkey && m->comparator(e->key, key) == 0)
          return e;
-      }
    }
    return NULL;
 }
 
-// NB: key must be a copy of the key. We will take care of it!
+void grow_map(map_t* m)
+{
+   // Double everything, then rebuild the slots from the stored hashes. Entries keep their index in the pool
+   m->size *= 2;
+   m->capacity = (m->size * MAX_LOAD_PERCENT) / 100;
+   m->entries = realloc(m->entries, sizeof(map_entry_t) * m->capacity);
+   free(m->slots);
+   m->slots = calloc(sizeof(uint32_t), m->size);
+   uint32_t mask = m->size - 1;
+   for (uint32_t j = 0; j < m->usage; j++)
+   {
+      uint32_t i = m->entries[j].hashkey & mask;
+      while (m->slots[i] != 0)
+         i = (i + 1) & mask;
+      m->slots[i] = j + 1;
+   }
+}
+
+// NB: key must be a copy of the key (except in a symbol map, where it is an interned handle). We will take care of it!
 void map_put(map_t* m, void* key, void* value)
 {
-   map_entry_t* e = find_entry(m, key);
+   uint32_t hashkey = m->hash_fn(key);
+   map_entry_t* e = find_entry(m, key, hashkey);
    if (e)
+   {
+      // The stored key stays, so the copy we were given is not needed
+      if (m->free_key && key != e->key)
+         m->free_key(key);
       e->value = value;
+   }
    else
    {
-      m->usage++;
-      // FIXME: Rehash everything here if usage is too high
-      uint32_t hashkey = m->hash_fn(key) % m->size;
-      e = malloc(sizeof(map_entry_t));
-      e->next = m->entries[hashkey];
-      e->hashkey = hashkey; // For rehashing later
+      if (m->usage == m->capacity)
+         grow_map(m);
+      uint32_t mask = m->size - 1;
+      uint32_t i = hashkey & mask;
+      while (m->slots[i] != 0)
+         i = (i + 1) & mask;
+      e = &m->entries[m->usage++];
+      e->hashkey = hashkey;
       e->value = value;
-      e->key = key;      
-      m->entries[hashkey] = e;
+      e->key = key;
+      m->slots[i] = m->usage;
    }
 }
 
 int map_get(map_t* m, void* key, void** value)
 {
-   map_entry_t* e = find_entry(m, key);
+   map_entry_t* e = find_entry(m, key, m->hash_fn(key));
    if (e == NULL)
       return 0;
    *value = e->value;
@@ -121,13 +171,117 @@ uint32_t map_size(map_t* m)
    return m->usage;
 }
 
-void forall(map_t* m, void (*fn)(char*, void*))
+void forall(map_t* m, void (*fn)(void*, void*))
+{
+   for (int i = 0; i < m->usage; i++)
+      fn(m->entries[i].key, m->entries[i].value);
+}
+
+
+// The integer map keeps keys and values directly in the slots, so a lookup is a multiply, a mask and (usually) a single compare
+#define INITIAL_INT_MAP_BITS 6
+
+typedef struct
+{
+   uint32_t key;
+   uint32_t used;
+   void* value;
+} int_map_entry_t;
+
+struct int_map_t
+{
+   int_map_entry_t* slots;
+   void (*free_fn)(void*);
+   uint32_t bits;
+   uint32_t usage;
+};
+
+// Fibonacci hashing: the top bits of the product are well mixed even when the keys are all multiples of the page size
+#define INT_HASH(key, bits) (((key) * 0x9E3779B1u) >> (32 - (bits)))
+
+int_map_t* alloc_int_map(void (*free_fn)(void*))
+{
+   int_map_t* map = malloc(sizeof(int_map_t));
+   map->bits = INITIAL_INT_MAP_BITS;
+   map->usage = 0;
+   map->free_fn = free_fn;
+   map->slots = calloc(sizeof(int_map_entry_t), 1 << map->bits);
+   return map;
+}
+
+void free_int_map(int_map_t* m)
+{
+   if (m->free_fn)
+   {
+      for (int i = 0; i < (1 << m->bits); i++)
+      {
+         if (m->slots[i].used)
+            m->free_fn(m->slots[i].value);
+      }
+   }
+   free(m->slots);
+   free(m);
+}
+
+int_map_entry_t* find_int_slot(int_map_entry_t* slots, uint32_t bits, uint32_t key)
+{
+   uint32_t mask = (1 << bits) - 1;
+   uint32_t i = INT_HASH(key, bits);
+   while (slots[i].used && slots[i].key != key)
+      i = (i + 1) & mask;
+   return &slots[i];
+}
+
+void grow_int_map(int_map_t* m)
+{
+   int_map_entry_t* old_slots = m->slots;
+   uint32_t old_size = 1 << m->bits;
+   m->bits++;
+   m->slots = calloc(sizeof(int_map_entry_t), 1 << m->bits);
+   for (int i = 0; i < old_size; i++)
+   {
+      if (old_slots[i].used)
+         *find_int_slot(m->slots, m->bits, old_slots[i].key) = old_slots[i];
+   }
+   free(old_slots);
+}
+
+void int_map_put(int_map_t* m, uint32_t key, void* value)
 {
-   for (int i = 0; i < m->size; i++)
+   int_map_entry_t* e = find_int_slot(m->slots, m->bits, key);
+   if (!e->used)
    {
-      for (map_entry_t* e = m->entries[i]; e; e = e->next)
+      if ((m->usage + 1) * 100 > (1 << m->bits) * MAX_LOAD_PERCENT)
       {
-         fn(e->key, e->value);
+         grow_int_map(m);
+         e = find_int_slot(m->slots, m->bits, key);
       }
+      m->usage++;
+      e->used = 1;
+      e->key = key;
+   }
+   e->value = value;
+}
+
+int int_map_get(int_map_t* m, uint32_t key, void** value)
+{
+   int_map_entry_t* e = find_int_slot(m->slots, m->bits, key);
+   if (!e->used)
+      return 0;
+   *value = e->value;
+   return 1;
+}
+
+uint32_t int_map_size(int_map_t* m)
+{
+   return m->usage;
+}
+
+void int_map_forall(int_map_t* m, void (*fn)(uint32_t, void*))
+{
+   for (int i = 0; i < (1 << m->bits); i++)
+   {
+      if (m->slots[i].used)
+         fn(m->slots[i].key, m->slots[i].value);
    }
 }
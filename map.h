@@ -2,10 +2,22 @@
 
 typedef struct map_t map_t;
 
+uint32_t djb2(void* ptr);
 map_t* alloc_map(void (*free_fn)(void*), uint32_t (*hash_fn)(void* ptr), int (*comparator)(void*, void*));
 map_t* alloc_char_map(void (*free_fn)(void*));
+map_t* alloc_symbol_map(void (*free_fn)(void*));
 void free_map(map_t* m);
 void map_put(map_t* m, void* key, void* value);
 int map_get(map_t* m, void* key, void** value);
 uint32_t map_size(map_t* m);
 void forall(map_t* m, void (*fn)(void*, void*));
+
+// Map specialised for uint32_t keys (typically guest addresses). Keys are stored inline and are never freed
+typedef struct int_map_t int_map_t;
+
+int_map_t* alloc_int_map(void (*free_fn)(void*));
+void free_int_map(int_map_t* m);
+void int_map_put(int_map_t* m, uint32_t key, void* value);
+int int_map_get(int_map_t* m, uint32_t key, void** value);
+uint32_t int_map_size(int_map_t* m);
+void int_map_forall(int_map_t* m, void (*fn)(uint32_t, void*));
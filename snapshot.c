@@ -0,0 +1,580 @@
+// Snapshots of the whole machine, taken once everything is loaded and initialized (or later), so that a run can start from there.
+// Guest memory that came from a file is stored as a reference to the file, plus whichever of its pages we have changed since. Other
+// memory is stored as it is. Both are mapped straight out of the snapshot copy-on-write when it is restored, so nothing is read in
+// until it is used
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "machine.h"
+#include "loader.h"
+#include "image.h"
+#include "dyld_cache.h"
+#include "snapshot.h"
+#include "coverage.h"
+#include "context.h"
+
+#define SNAPSHOT_MAGIC "armulator-snp-1"
+// The files are read back this much at a time, to compare against what is mapped
+#define SNAPSHOT_COMPARE_CHUNK (1024 * 1024)
+
+typedef struct
+{
+   char magic[16];
+   uint32_t state_size;          // A snapshot is only any use to the build that wrote it, and this is a cheap way to notice most others
+   uint32_t page_size;           // Of the host that wrote it. Page contents are aligned to this so they can be mapped directly
+   uint32_t cache_slide;
+   uint64_t metadata_offset;     // Everything but the page contents comes at the end, once we know how much room the contents took
+   uint64_t instructions_executed;
+   state_t state;
+} snapshot_header_t;
+
+// Set by any read or write that fails. Rather than check every field, the callers check this once they are done with each part
+__thread uint8_t snapshot_io_failed = 0;
+
+void write_u32(FILE* file, uint32_t value)
+{
+   if (fwrite(&value, sizeof(uint32_t), 1, file) != 1)
+      snapshot_io_failed = 1;
+}
+
+void write_u64(FILE* file, uint64_t value)
+{
+   if (fwrite(&value, sizeof(uint64_t), 1, file) != 1)
+      snapshot_io_failed = 1;
+}
+
+void write_bytes(FILE* file, void* data, uint32_t length)
+{
+   write_u32(file, length);
+   if (length != 0 && fwrite(data, length, 1, file) != 1)
+      snapshot_io_failed = 1;
+}
+
+void write_string(FILE* file, const char* s)
+{
+   write_bytes(file, (void*)s, (s == NULL)?0:strlen(s) + 1);
+}
+
+// These all read as 0 (or NULL) once anything has failed, so that loops over what they read come to an end
+uint32_t read_u32(FILE* file)
+{
+   uint32_t value;
+   if (snapshot_io_failed || fread(&value, sizeof(uint32_t), 1, file) != 1)
+   {
+      snapshot_io_failed = 1;
+      return 0;
+   }
+   return value;
+}
+
+uint64_t read_u64(FILE* file)
+{
+   uint64_t value;
+   if (snapshot_io_failed || fread(&value, sizeof(uint64_t), 1, file) != 1)
+   {
+      snapshot_io_failed = 1;
+      return 0;
+   }
+   return value;
+}
+
+// Returns a malloc()ed copy, or NULL if nothing was written
+void* read_bytes(FILE* file, uint32_t* length)
+{
+   *length = read_u32(file);
+   if (*length == 0)
+      return NULL;
+   void* data = malloc(*length);
+   if (data == NULL || fread(data, *length, 1, file) != 1)
+   {
+      snapshot_io_failed = 1;
+      free(data);
+      *length = 0;
+      return NULL;
+   }
+   return data;
+}
+
+char* read_string(FILE* file)
+{
+   uint32_t length;
+   return read_bytes(file, &length);
+}
+
+// Page contents go at the next page boundary, so that they can be mapped back in. Returns where that was
+uint64_t write_pages(FILE* file, unsigned char* data, size_t length, uint32_t page_size)
+{
+   uint64_t offset = (ftell(file) + page_size - 1) & ~(uint64_t)(page_size - 1);
+   if (fseek(file, offset, SEEK_SET) != 0 || (length != 0 && fwrite(data, length, 1, file) != 1))
+      snapshot_io_failed = 1;
+   return offset;
+}
+
+int32_t file_index(mapped_file_t** files, uint32_t file_count, unsigned char* data)
+{
+   for (uint32_t i = 0; i < file_count; i++)
+   {
+      if (data >= files[i]->data && data < files[i]->data + files[i]->length)
+         return i;
+   }
+   return -1;
+}
+
+int32_t image_index(image_t* image)
+{
+   int32_t i = 0;
+   for (image_t* x = images; x; x = x->next, i++)
+   {
+      if (x == image)
+         return i;
+   }
+   return -1;
+}
+
+__thread FILE* breakpoint_file = NULL;
+
+void write_breakpoint(uint32_t address, void* ptr)
+{
+   breakpoint_t* breakpoint = ptr;
+   write_u32(breakpoint_file, address);
+   write_string(breakpoint_file, breakpoint->symbol->name);
+   write_u32(breakpoint_file, breakpoint->handler != NULL);
+   write_u32(breakpoint_file, breakpoint->lazy_pointer);
+   write_u32(breakpoint_file, image_index(breakpoint->image));
+   write_u32(breakpoint_file, breakpoint->ordinal);
+}
+
+// Returns 0 (and leaves nothing behind) if the snapshot could not be written in full
+int save_snapshot(char* filename)
+{
+   uint32_t page_size = sysconf(_SC_PAGESIZE);
+   FILE* file = fopen(filename, "wb");
+   if (file == NULL)
+   {
+      printf("Could not write snapshot to %s\n", filename);
+      return 0;
+   }
+   snapshot_io_failed = 0;
+   snapshot_header_t header;
+   memset(&header, 0, sizeof(snapshot_header_t));
+   if (fwrite(&header, sizeof(snapshot_header_t), 1, file) != 1)
+      snapshot_io_failed = 1;
+
+   // Regions are restored oldest first, so that each shadows the same ones it did originally
+   uint32_t region_count = 0;
+   for (page_table_t* t = page_tables; t; t = t->next)
+      region_count++;
+   page_table_t** regions = malloc(sizeof(page_table_t*) * region_count);
+   uint64_t* region_contents = malloc(sizeof(uint64_t) * region_count);
+   uint32_t i = region_count;
+   for (page_table_t* t = page_tables; t; t = t->next)
+      regions[--i] = t;
+   uint32_t file_count = 0;
+   for (mapped_file_t* f = mapped_files; f; f = f->next)
+      file_count++;
+   mapped_file_t** files = malloc(sizeof(mapped_file_t*) * file_count);
+   i = 0;
+   for (mapped_file_t* f = mapped_files; f; f = f->next)
+      files[i++] = f;
+
+   // Anything not from a file is stored whole
+   for (i = 0; i < region_count; i++)
+   {
+      if (file_index(files, file_count, regions[i]->data) == -1)
+         region_contents[i] = write_pages(file, regions[i]->data, regions[i]->length, page_size);
+   }
+
+   // Of the files, only the pages that no longer match the file have changed. Nothing short of comparing tells us which those are: a
+   // page can be written without write_mem() (the cache fixups, for one), and one that was copied on write may since have been swapped out
+   uint64_t** dirty_pages = malloc(sizeof(uint64_t*) * file_count);
+   uint32_t* dirty_count = calloc(sizeof(uint32_t), file_count);
+   uint64_t dirty_total = 0;
+   uint32_t chunk_size = (SNAPSHOT_COMPARE_CHUNK / page_size) * page_size;
+   unsigned char* original = malloc(chunk_size);
+   for (i = 0; i < file_count; i++)
+   {
+      uint32_t pages = (files[i]->length + page_size - 1) / page_size;
+      dirty_pages[i] = malloc(sizeof(uint64_t) * 2 * pages);
+      int fd = open(files[i]->path, O_RDONLY);
+      if (fd == -1)
+      {
+         printf("Could not tell which pages of %s have changed\n", files[i]->path);
+         snapshot_io_failed = 1;
+         continue;
+      }
+      for (uint64_t chunk = 0; chunk < files[i]->length; chunk += chunk_size)
+      {
+         size_t length = (files[i]->length - chunk < chunk_size)?(files[i]->length - chunk):chunk_size;
+         if (pread(fd, original, length, chunk) != length)
+         {
+            snapshot_io_failed = 1;
+            break;
+         }
+         for (size_t page = 0; page < length; page += page_size)
+         {
+            uint64_t offset = chunk + page;
+            size_t compare = (length - page < page_size)?(length - page):page_size;
+            if (memcmp(&original[page], &files[i]->data[offset], compare) == 0)
+               continue;
+            dirty_pages[i][2 * dirty_count[i]] = offset;
+            dirty_pages[i][2 * dirty_count[i] + 1] = write_pages(file, &files[i]->data[offset], page_size, page_size);
+            dirty_count[i]++;
+         }
+      }
+      dirty_total += dirty_count[i];
+      close(fd);
+   }
+   free(original);
+
+   header.metadata_offset = ftell(file);
+   for (i = 0; i < file_count; i++)
+   {
+      struct stat info;
+      if (stat(files[i]->path, &info) != 0)
+         snapshot_io_failed = 1;
+      write_string(file, files[i]->path);
+      write_u64(file, files[i]->length);
+      write_u64(file, info.st_mtime);
+      write_u32(file, dirty_count[i]);
+      for (uint32_t j = 0; j < 2 * dirty_count[i]; j++)
+         write_u64(file, dirty_pages[i][j]);
+      free(dirty_pages[i]);
+   }
+   write_string(file, NULL);
+   write_u32(file, region_count);
+   for (i = 0; i < region_count; i++)
+   {
+      page_table_t* t = regions[i];
+      int32_t index = file_index(files, file_count, t->data);
+      write_u32(file, t->address);
+      write_u32(file, t->length);
+      write_u32(file, index);
+      write_u64(file, (index == -1)?region_contents[i]:(uint64_t)(t->data - files[index]->data));
+      // The only regions with a fixup are slid cache images
+      uint32_t pages = (t->address + t->length) / VPAGE_SIZE - t->address / VPAGE_SIZE + 1;
+      write_bytes(file, t->unfixed, (t->unfixed == NULL)?0:(pages + 7) / 8);
+   }
+   uint32_t slid_length;
+   uint8_t* slid_pages = cache_slid_pages(&slid_length);
+   write_bytes(file, slid_pages, slid_length);
+   write_u32(file, next_page);
+   write_u32(file, next_break);
+   write_u32(file, next_relocated_image);
+
+   uint32_t image_count = 0;
+   for (image_t* image = images; image; image = image->next)
+      image_count++;
+   write_u32(file, image_count);
+   for (image_t* image = images; image; image = image->next)
+   {
+      int32_t index = (image->data == NULL)?-1:file_index(files, file_count, image->data);
+      write_string(file, image->name->name);
+      write_u32(file, image->state);
+      write_u32(file, index);
+      write_u64(file, (index == -1)?0:(uint64_t)(image->data - files[index]->data));
+      write_u32(file, image->offset);
+      write_u32(file, image->base_address);
+      write_u32(file, image->slide);
+   }
+   write_u32(file, int_map_size(breakpoints));
+   breakpoint_file = file;
+   int_map_forall(breakpoints, write_breakpoint);
+
+   memcpy(header.magic, SNAPSHOT_MAGIC, 16);
+   header.state_size = sizeof(state_t);
+   header.page_size = page_size;
+   header.cache_slide = cache_slide;
+   header.instructions_executed = instructions_executed;
+   header.state = state;
+   if (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(snapshot_header_t), 1, file) != 1)
+      snapshot_io_failed = 1;
+   if (fclose(file) != 0)
+      snapshot_io_failed = 1;
+   free(regions);
+   free(region_contents);
+   free(files);
+   free(dirty_pages);
+   free(dirty_count);
+   if (snapshot_io_failed)
+   {
+      // A partial snapshot would only fail to load later, so do not leave one about
+      printf("Could not write snapshot to %s\n", filename);
+      unlink(filename);
+      return 0;
+   }
+   printf("Saved snapshot to %s after %llu instructions (%d regions, %llu changed file pages)\n", filename, instructions_executed, region_count, dirty_total);
+   return 1;
+}
+
+// Maps page contents out of the snapshot. length is rounded up to whole pages. NULL if that cannot be done
+unsigned char* map_snapshot_pages(int fd, void* where, uint64_t offset, size_t length)
+{
+   unsigned char* data = mmap(where, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | ((where == NULL)?0:MAP_FIXED), fd, offset);
+   if (data == MAP_FAILED)
+   {
+      snapshot_io_failed = 1;
+      return NULL;
+   }
+   return data;
+}
+
+// For when the snapshot turns out to be cut short or damaged part way through. The machine is left half restored, so is no use
+int snapshot_damaged(FILE* file, char* filename)
+{
+   printf("Snapshot %s is damaged or incomplete\n", filename);
+   fclose(file);
+   return 0;
+}
+
+mapped_file_t* find_mapped_file(char* path)
+{
+   for (mapped_file_t* f = mapped_files; f; f = f->next)
+   {
+      if (strcmp(f->path, path) == 0)
+         return f;
+   }
+   return NULL;
+}
+
+// The images were loaded before the snapshot was taken, so --coverage-module has to find out where their segments are from here
+void note_restored_segments(image_t* image)
+{
+   struct mach_header* header = (struct mach_header*)image->data;
+   struct load_command* command = (struct load_command*)(image->data + sizeof(struct mach_header));
+   for (uint32_t i = 0; i < header->ncmds; i++)
+   {
+      if (command->cmd == LC_SEGMENT)
+      {
+         struct segment_command* c = (struct segment_command*)command;
+         coverage_note_segment(image->name, c->vmaddr + image->slide, c->vmsize);
+      }
+      command = (struct load_command*)((char*)command + command->cmdsize);
+   }
+}
+
+// This stands in for loading the executable, into a machine that has been created (so has its loader and stubs) but nothing more
+int load_snapshot(char* filename)
+{
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   FILE* file = fopen(filename, "rb");
+   if (file == NULL)
+   {
+      printf("Could not open snapshot %s\n", filename);
+      return 0;
+   }
+   snapshot_header_t header;
+   if (fread(&header, sizeof(snapshot_header_t), 1, file) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, 16) != 0 || header.state_size != sizeof(state_t))
+   {
+      printf("%s is not a snapshot made by this version\n", filename);
+      fclose(file);
+      return 0;
+   }
+   if (header.page_size != sysconf(_SC_PAGESIZE))
+   {
+      printf("%s was made on a host with %d byte pages, so it cannot be mapped here\n", filename, header.page_size);
+      fclose(file);
+      return 0;
+   }
+   // The cache has to be slid the same way as last time. The slide is shared by every machine in the process, so it is up to whoever
+   // set it to get it right, rather than for one snapshot to change it under the others
+   if (header.cache_slide != cache_slide)
+   {
+      printf("%s was taken with --cache-slide 0x%x, not 0x%x\n", filename, header.cache_slide, cache_slide);
+      fclose(file);
+      return 0;
+   }
+   int fd = fileno(file);
+   snapshot_io_failed = 0;
+   if (fseek(file, header.metadata_offset, SEEK_SET) != 0)
+      return snapshot_damaged(file, filename);
+   mapped_file_t** files = NULL;
+   uint32_t file_count = 0;
+   char* path;
+   while ((path = read_string(file)) != NULL)
+   {
+      struct stat info;
+      uint64_t length = read_u64(file);
+      uint64_t modified = read_u64(file);
+      if (stat(path, &info) != 0 || info.st_size != length || info.st_mtime != modified)
+      {
+         printf("%s has changed since the snapshot was taken\n", path);
+         free(path);
+         free(files);
+         fclose(file);
+         return 0;
+      }
+      // The cache will have been mapped already
+      mapped_file_t* mapped = find_mapped_file(path);
+      if (mapped == NULL)
+      {
+         if (map_file(path, NULL) == NULL)
+         {
+            free(path);
+            free(files);
+            fclose(file);
+            return 0;
+         }
+         mapped = mapped_files;
+      }
+      uint32_t dirty_count = read_u32(file);
+      for (uint32_t i = 0; i < dirty_count && !snapshot_io_failed; i++)
+      {
+         uint64_t offset = read_u64(file);
+         uint64_t contents = read_u64(file);
+         if (offset >= mapped->length)
+            snapshot_io_failed = 1;
+         else if (!snapshot_io_failed)
+            map_snapshot_pages(fd, &mapped->data[offset], contents, header.page_size);
+      }
+      files = realloc(files, sizeof(mapped_file_t*) * (file_count + 1));
+      files[file_count++] = mapped;
+      free(path);
+   }
+   if (snapshot_io_failed)
+   {
+      free(files);
+      return snapshot_damaged(file, filename);
+   }
+
+   // Whatever got mapped while preparing the loader is replaced wholesale
+   unmap_all_memory();
+   uint32_t region_count = read_u32(file);
+   for (uint32_t i = 0; i < region_count; i++)
+   {
+      uint32_t address = read_u32(file);
+      uint32_t length = read_u32(file);
+      int32_t index = read_u32(file);
+      uint64_t offset = read_u64(file);
+      uint32_t unfixed_length;
+      uint8_t* unfixed = read_bytes(file, &unfixed_length);
+      unsigned char* data = NULL;
+      if (index == -1)
+         data = map_snapshot_pages(fd, NULL, offset, (length == 0)?1:length);
+      else if (index >= 0 && index < file_count && offset + length <= files[index]->length)
+         data = &files[index]->data[offset];
+      uint32_t pages = (address + length) / VPAGE_SIZE - address / VPAGE_SIZE + 1;
+      if (snapshot_io_failed || data == NULL || (unfixed != NULL && unfixed_length != (pages + 7) / 8))
+      {
+         if (index == -1 && data != NULL)
+            munmap(data, (length == 0)?1:length);
+         free(unfixed);
+         free(files);
+         return snapshot_damaged(file, filename);
+      }
+      if (unfixed == NULL)
+         map_memory(data, address, length);
+      else
+      {
+         map_memory_with_fixup(data, address, length, slide_cache_page);
+         memcpy(page_tables->unfixed, unfixed, unfixed_length);
+         free(unfixed);
+      }
+      page_tables->mapped = (index == -1);
+   }
+   uint32_t slid_length;
+   uint32_t expected_length;
+   uint8_t* slid = read_bytes(file, &slid_length);
+   uint8_t* slid_pages = cache_slid_pages(&expected_length);
+   if (snapshot_io_failed || slid_length != expected_length)
+   {
+      free(slid);
+      free(files);
+      return snapshot_damaged(file, filename);
+   }
+   if (slid != NULL)
+      memcpy(slid_pages, slid, slid_length);
+   free(slid);
+   next_page = read_u32(file);
+   next_break = read_u32(file);
+   next_relocated_image = read_u32(file);
+
+   // Images are only needed for binding from here on: lazy pointers, and anything bound as a result of a later dlopen()
+   uint32_t image_count = read_u32(file);
+   image_t** restored = malloc(sizeof(image_t*) * image_count);
+   for (uint32_t i = 0; i < image_count; i++)
+   {
+      char* name = read_string(file);
+      image_state_t image_state = read_u32(file);
+      int32_t index = read_u32(file);
+      uint64_t offset = read_u64(file);
+      uint32_t image_offset = read_u32(file);
+      if (snapshot_io_failed || name == NULL || index < -1 || index >= (int32_t)file_count || (index != -1 && offset >= files[index]->length))
+      {
+         free(name);
+         free(restored);
+         free(files);
+         return snapshot_damaged(file, filename);
+      }
+      image_t* image = add_image(intern(name));
+      image->offset = image_offset;
+      if (index != -1)
+      {
+         image->data = &files[index]->data[offset];
+         scan_image_headers(image);
+      }
+      image->state = image_state;
+      image->base_address = read_u32(file);
+      image->slide = read_u32(file);
+      if (index != -1 && image_state == IMAGE_LOADED)
+         note_restored_segments(image);
+      restored[i] = image;
+      free(name);
+   }
+
+   // The stubs were registered when the machine was created, and had better have ended up where they were before. Trampolines for lazy pointers
+   // were made as images were bound, so those have to be put back
+   uint32_t breakpoint_count = read_u32(file);
+   for (uint32_t i = 0; i < breakpoint_count; i++)
+   {
+      uint32_t address = read_u32(file);
+      char* name = read_string(file);
+      uint32_t is_stub = read_u32(file);
+      uint32_t lazy_pointer = read_u32(file);
+      int32_t index = read_u32(file);
+      uint32_t ordinal = read_u32(file);
+      if (snapshot_io_failed || name == NULL || index < -1 || index >= (int32_t)image_count)
+      {
+         free(name);
+         free(restored);
+         free(files);
+         return snapshot_damaged(file, filename);
+      }
+      symbol_t symbol = intern(name);
+      free(name);
+      if (is_stub)
+      {
+         breakpoint_t* breakpoint;
+         if (!int_map_get(breakpoints, address, (void**)&breakpoint) || breakpoint->symbol != symbol)
+         {
+            printf("The stub for %s has moved since the snapshot was taken\n", symbol->name);
+            free(restored);
+            free(files);
+            fclose(file);
+            return 0;
+         }
+      }
+      else
+         restore_lazy_breakpoint(address, symbol, lazy_pointer, (index == -1)?NULL:restored[index], ordinal);
+   }
+   free(restored);
+   free(files);
+
+   state = header.state;
+   instructions_executed = header.instructions_executed;
+   fclose(file);
+   printf("Restored snapshot %s (%d regions, %d images) in %.3fms\n", filename, region_count, image_count, milliseconds_since(&start));
+   return 1;
+}
+
+void snapshot_context(context_t* c)
+{
+   CONTEXT_VAR(c, snapshot_io_failed);
+   CONTEXT_VAR(c, breakpoint_file);
+}
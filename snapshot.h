@@ -0,0 +1,2 @@
+int save_snapshot(char* filename);
+int load_snapshot(char* filename);
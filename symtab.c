@@ -1,112 +1,293 @@
 #include "map.h"
 #include "machine.h"
+#include "symtab.h"
+#include "image.h"
+#include "loader.h"
+#include "context.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-map_t* symtab = NULL;
+// Symbols defined explicitly (ie stubs). These take precedence over anything exported by an image
+__thread map_t* symtab = NULL;
+// Answers to previous flat-namespace lookups
+__thread map_t* flat_cache = NULL;
 
-struct entry_binding_t
+// Every place that needs a symbol filled in is queued here, and resolved in bulk by bind_pending_symbols()
+typedef struct
 {
+   symbol_t symbol;
    uint32_t target;
-   struct entry_binding_t* next;
-};
+   uint32_t value;
+   image_t* image;      // The image doing the binding, and the ordinal of the library it expects the symbol to come from
+   uint32_t ordinal;
+} bind_request_t;
 
-typedef struct entry_binding_t entry_binding_t;
+__thread bind_request_t* pending_binds = NULL;
+__thread uint32_t pending_count = 0;
+__thread uint32_t pending_capacity = 0;
 
+// Requests that could not be resolved when they were queued. Those whose library has not been loaded yet wait for it, by its name;
+// the rest are only worth checking against each new image's exports, in case it has the symbol for a flat lookup
 typedef struct
 {
-   uint32_t value;
-   entry_binding_t* bindings;
-} symtab_entry_t;
+   bind_request_t* binds;
+   uint32_t count;
+   uint32_t capacity;
+} bind_list_t;
+
+__thread map_t* waiting_binds = NULL;
+__thread bind_list_t unresolved_binds = {NULL, 0, 0};
 
-void bind_symbol(uint32_t target, uint32_t value)
+void add_bind(bind_list_t* list, bind_request_t* bind)
 {
-   write_mem(4, target, value);
+   if (list->count == list->capacity)
+   {
+      list->capacity = (list->capacity == 0)?64:(list->capacity * 2);
+      list->binds = realloc(list->binds, sizeof(bind_request_t) * list->capacity);
+   }
+   list->binds[list->count++] = *bind;
 }
 
-void free_symtab_entry(void* entryt)
+void free_bind_list(void* ptr)
 {
-   symtab_entry_t* entry = (symtab_entry_t*) entryt;
-   while (entry->bindings)
+   bind_list_t* list = ptr;
+   if (list == NULL)
+      return;
+   free(list->binds);
+   free(list);
+}
+
+void park_bind(bind_request_t* bind)
+{
+   image_t* library = (bind->image == NULL)?NULL:image_for_ordinal(bind->image, bind->ordinal);
+   if (library == NULL || library->state == IMAGE_LOADED || library->state == IMAGE_MISSING)
+   {
+      add_bind(&unresolved_binds, bind);
+      return;
+   }
+   bind_list_t* list;
+   if (waiting_binds == NULL)
+      waiting_binds = alloc_symbol_map(free_bind_list);
+   if (!map_get(waiting_binds, (void*)library->name, (void**)&list) || list == NULL)
    {
-      entry_binding_t* b = entry->bindings;
-      entry->bindings = b->next;
-      free(b);
+      list = calloc(1, sizeof(bind_list_t));
+      map_put(waiting_binds, (void*)library->name, list);
    }
-   free(entry);
+   add_bind(list, bind);
 }
 
-void found_symbol(char* symbol_name, uint32_t value)
+void found_symbol(symbol_t symbol_name, uint32_t value)
 {
-   symtab_entry_t* entry;
    if (symtab == NULL)
-      symtab = alloc_char_map(free_symtab_entry);
-   printf("   Found symbol %s at %08x\n", symbol_name, value);
-   if (map_get(symtab, symbol_name, (void**)&entry) == 0)
+      symtab = alloc_symbol_map(NULL);
+   printf("   Found symbol %s at %08x\n", symbol_name->name, value);
+   map_put(symtab, (void*)symbol_name, (void*)(uintptr_t)value);
+}
+
+int lookup_symbol(symbol_t symbol_name, uint32_t* value)
+{
+   void* v;
+   if (symtab != NULL && map_get(symtab, (void*)symbol_name, &v))
    {
-      entry = malloc(sizeof(symtab_entry_t));
-      entry->value = value;
-      entry->bindings = NULL;
-      map_put(symtab, strdup(symbol_name), entry);
+      *value = (uint32_t)(uintptr_t)v;
+      return 1;
    }
-   else
+   if (flat_cache != NULL && map_get(flat_cache, (void*)symbol_name, &v))
    {
-      entry->value = value;
-      while (entry->bindings)
-      {
-         entry_binding_t* b = entry->bindings;
-         bind_symbol(b->target, value);
-         entry->bindings = b->next;
-         free(b);
-      }
+      *value = (uint32_t)(uintptr_t)v;
+      return 1;
    }
+   // Search every image's export trie, and remember the answer so we only ever do this once per symbol
+   if (find_any_export(symbol_name, value))
+   {
+      if (flat_cache == NULL)
+         flat_cache = alloc_symbol_map(NULL);
+      map_put(flat_cache, (void*)symbol_name, (void*)(uintptr_t)*value);
+      return 1;
+   }
+   return 0;
 }
 
-void need_symbol(char* symbol_name, uint32_t target)
+// Two-level namespace lookup: only the library named by the ordinal (and whatever it re-exports) is searched. The flat namespace is
+// for binds that ask for it, and for those whose library cannot be found at all. The latter are not cached, since another image may
+// want the same name from a library that is there
+int resolve_symbol(image_t* image, uint32_t ordinal, symbol_t symbol_name, uint32_t* value)
 {
-   if (symtab == NULL)
-      symtab = alloc_char_map(free_symtab_entry);
-   symtab_entry_t* entry;
-   if (map_get(symtab, symbol_name, (void**)&entry) == 0)
+   void* v;
+   if (symtab != NULL && map_get(symtab, (void*)symbol_name, &v))
    {
-      printf("   Need to find symbol %s to fill in stub at %08x\n", symbol_name, target);
-      entry = malloc(sizeof(symtab_entry_t));
-      entry->value = 0;
-      entry->bindings = malloc(sizeof(entry_binding_t));
-      entry->bindings->next = NULL;
-      entry->bindings->target = target;
-      map_put(symtab, strdup(symbol_name), entry);
+      *value = (uint32_t)(uintptr_t)v;
+      return 1;
    }
-   else if (entry->value != 0)
+   if (image == NULL || ordinal == DYNAMIC_LOOKUP_ORDINAL)
+      return lookup_symbol(symbol_name, value);
+   image_t* library = image_for_ordinal(image, ordinal);
+   if (library != NULL && library->state != IMAGE_MISSING)
    {
-      printf("  Request for symbol %s to fill in stub at %08x ---> We already have this symbol! %08x\n", symbol_name, target, entry->value);
-      bind_symbol(target, entry->value);
+      if (find_export(library, symbol_name, value))
+         return 1;
+      // Looking may have been what showed it to be missing
+      if (library->state != IMAGE_MISSING)
+         return 0;
    }
+   return find_any_export(symbol_name, value);
 }
 
-uint32_t undefined_count;
+void need_symbol(symbol_t symbol_name, uint32_t target, image_t* image, uint32_t ordinal)
+{
+   if (pending_count == pending_capacity)
+   {
+      pending_capacity = (pending_capacity == 0)?4096:(pending_capacity * 2);
+      pending_binds = realloc(pending_binds, sizeof(bind_request_t) * pending_capacity);
+   }
+   pending_binds[pending_count].symbol = symbol_name;
+   pending_binds[pending_count].target = target;
+   pending_binds[pending_count].image = image;
+   pending_binds[pending_count].ordinal = ordinal;
+   pending_count++;
+}
+
+int compare_bind_targets(const void* a, const void* b)
+{
+   uint32_t x = ((bind_request_t*)a)->target;
+   uint32_t y = ((bind_request_t*)b)->target;
+   return (x > y) - (x < y);
+}
 
-void check_entry(void* key, void* entry)
+// Resolves everything queued since last time, and whatever was waiting for the image that has just been loaded
+void bind_pending_symbols(image_t* loaded)
 {
-   if (((symtab_entry_t*)entry)->value == 0)
+   // Take the whole queue first, along with anything that was waiting on this image
+   bind_request_t* binds = pending_binds;
+   uint32_t count = pending_count;
+   uint32_t resolved = 0;
+   bind_list_t* waiting;
+   pending_binds = NULL;
+   pending_count = 0;
+   pending_capacity = 0;
+   if (loaded != NULL && waiting_binds != NULL && map_get(waiting_binds, (void*)loaded->name, (void**)&waiting) && waiting != NULL)
    {
-      undefined_count++;
-      printf("Undefined symbol: %s\n", (char*)key);
+      binds = realloc(binds, sizeof(bind_request_t) * (count + waiting->count));
+      memcpy(&binds[count], waiting->binds, sizeof(bind_request_t) * waiting->count);
+      count += waiting->count;
+      map_put(waiting_binds, (void*)loaded->name, NULL);
+      free_bind_list(waiting);
    }
-   else
+   // Requests nothing else could answer are only looked for in the new image. That can load more images, which bind in turn, so the
+   // list is taken first here too
+   if (loaded != NULL && unresolved_binds.count > 0)
    {
-      //printf("Symbol %s bound to address %08x\n", key, ((symtab_entry_t*)entry)->value);
+      bind_list_t unresolved = unresolved_binds;
+      memset(&unresolved_binds, 0, sizeof(bind_list_t));
+      // Room for all of them up front, rather than growing once per match
+      binds = realloc(binds, sizeof(bind_request_t) * (count + unresolved.count));
+      for (uint32_t i = 0; i < unresolved.count; i++)
+      {
+         uint32_t value;
+         if (find_export(loaded, unresolved.binds[i].symbol, &value))
+            binds[count++] = unresolved.binds[i];
+         else
+            add_bind(&unresolved_binds, &unresolved.binds[i]);
+      }
+      free(unresolved.binds);
    }
+   for (uint32_t i = 0; i < count; i++)
+   {
+      uint32_t value;
+      image_t* library = (binds[i].image == NULL)?NULL:image_for_ordinal(binds[i].image, binds[i].ordinal);
+      // Without --lazy-dylibs each library is loaded in its turn, and a bind into one that has not been yet waits for it rather than
+      // bringing it in out of order
+      if (!load_dylibs_lazily && library != NULL && (library->state == IMAGE_REGISTERED || library->state == IMAGE_OPENED))
+         park_bind(&binds[i]);
+      else if (resolve_symbol(binds[i].image, binds[i].ordinal, binds[i].symbol, &value))
+      {
+         binds[resolved] = binds[i];
+         binds[resolved].value = value;
+         resolved++;
+      }
+      else
+         park_bind(&binds[i]);
+   }
+   // Writing in address order means we walk each page once rather than hopping about
+   qsort(binds, resolved, sizeof(bind_request_t), compare_bind_targets);
+   for (uint32_t i = 0; i < resolved; i++)
+      write_mem(4, binds[i].target, binds[i].value);
+   printf("Bound %d symbols (%d left for later)\n", resolved, count - resolved);
+   free(binds);
+}
+
+int compare_bind_symbols(const void* a, const void* b)
+{
+   uintptr_t x = (uintptr_t)((bind_request_t*)a)->symbol;
+   uintptr_t y = (uintptr_t)((bind_request_t*)b)->symbol;
+   return (x > y) - (x < y);
+}
+
+void gather_waiting_binds(void* key, void* value)
+{
+   bind_list_t* list = value;
+   for (uint32_t i = 0; list != NULL && i < list->count; i++)
+      need_symbol(list->binds[i].symbol, list->binds[i].target, list->binds[i].image, list->binds[i].ordinal);
 }
 
 void dump_symtab()
 {
-   printf("Symtab has %d entries in it\n", map_size(symtab));
-   undefined_count = 0;
-   forall(symtab, check_entry);
+   uint32_t undefined_count = 0;
+   printf("Symtab has %d entries in it\n", (symtab == NULL)?0:map_size(symtab));
+   // Anything still unresolved could not be found in any image. Gather it all up (the next pass will sort it out again), and group
+   // the requests by symbol so each name is reported once
+   for (uint32_t i = 0; i < unresolved_binds.count; i++)
+      need_symbol(unresolved_binds.binds[i].symbol, unresolved_binds.binds[i].target, unresolved_binds.binds[i].image, unresolved_binds.binds[i].ordinal);
+   unresolved_binds.count = 0;
+   if (waiting_binds != NULL)
+   {
+      forall(waiting_binds, gather_waiting_binds);
+      free_map(waiting_binds);
+      waiting_binds = NULL;
+   }
+   qsort(pending_binds, pending_count, sizeof(bind_request_t), compare_bind_symbols);
+   for (uint32_t i = 0; i < pending_count; i++)
+   {
+      if (i > 0 && pending_binds[i].symbol == pending_binds[i-1].symbol)
+         continue;
+      undefined_count++;
+      printf("Undefined symbol: %s\n", pending_binds[i].symbol->name);
+   }
    if (undefined_count > 0)
    {
       printf("There were %d undefined symbols detected\n", undefined_count);
    }
 }
+
+void free_symtab()
+{
+   if (symtab != NULL)
+      free_map(symtab);
+   if (flat_cache != NULL)
+      free_map(flat_cache);
+   free(pending_binds);
+   if (waiting_binds != NULL)
+      free_map(waiting_binds);
+   free(unresolved_binds.binds);
+   symtab = NULL;
+   waiting_binds = NULL;
+   unresolved_binds.binds = NULL;
+   unresolved_binds.count = 0;
+   unresolved_binds.capacity = 0;
+   flat_cache = NULL;
+   pending_binds = NULL;
+   pending_count = 0;
+   pending_capacity = 0;
+}
+
+void symtab_context(context_t* c)
+{
+   CONTEXT_VAR(c, symtab);
+   CONTEXT_VAR(c, flat_cache);
+   CONTEXT_VAR(c, pending_binds);
+   CONTEXT_VAR(c, pending_count);
+   CONTEXT_VAR(c, pending_capacity);
+   CONTEXT_VAR(c, waiting_binds);
+   CONTEXT_VAR(c, unresolved_binds);
+}
@@ -1,3 +1,9 @@
-void need_symbol(char* symbol_name, uint32_t target);
-void found_symbol(char* symbol_name, uint32_t value);
+#include "intern.h"
+#include "image.h"
+void need_symbol(symbol_t symbol_name, uint32_t target, image_t* image, uint32_t ordinal);
+void found_symbol(symbol_t symbol_name, uint32_t value);
+int lookup_symbol(symbol_t symbol_name, uint32_t* value);
+int resolve_symbol(image_t* image, uint32_t ordinal, symbol_t symbol_name, uint32_t* value);
+void bind_pending_symbols(image_t* loaded);
 void dump_symtab();
+void free_symtab();
@@ -39,6 +39,13 @@ uint32_t mach_msg_trap()
 
 /* Posix ............... */
 
+uint32_t posix_exit()
+{
+   printf(" .... Hello from exit(%d)\n", A0);
+   machine_exit(A0);
+   return 0;
+}
+
 uint32_t posix_sigprocmask()
 {
    printf(" .... Hello from sigprocmask(%08x, %08x, %08x)\n", A0, A1, A2);
@@ -67,7 +74,8 @@ uint32_t posix_semwait_signal_nocancel()
 uint32_t (*mach_call[256])(void) = {[0x1a] = mach_reply_port,
                                     [0x1c] = mach_task_self,
                                     [0x1f] = mach_msg_trap};
-uint32_t (*posix_call[512])(void) = {[0x14] = posix_getpid,
+uint32_t (*posix_call[512])(void) = {[0x01] = posix_exit,
+                                     [0x14] = posix_getpid,
                                      [0x25] = posix_kill,
                                      [0x30] = posix_sigprocmask,
                                      [0x1a7] = posix_semwait_signal_nocancel};